@@ -0,0 +1,59 @@
+#!/bin/sh
+
+# Copyright (C) 2024 by Yuri Victorovich. All rights reserved.
+
+#
+# bench-fetch.sh: fetches a corpus served by bench/mock-server into an empty database, and reports the throughput
+#
+# usage: bench-fetch.sh {corpus-dir} [mock-server options...]
+#
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "usage: $0 {corpus-dir} [mock-server options...]" >&2
+	exit 1
+fi
+CORPUS=$1
+shift
+BUILDSDB=${BUILDSDB:-./buildsdb}
+MOCK_SERVER=${MOCK_SERVER:-bench/mock-server}
+
+WORK=$(mktemp -d -t buildsdb-bench.XXXXXX)
+SERVER_PID=
+cleanup() {
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null && wait $SERVER_PID 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+# start the server on a free port
+$MOCK_SERVER --root "$CORPUS" --port 0 "$@" > "$WORK/server.log" &
+SERVER_PID=$!
+while ! grep -q "^listening on" "$WORK/server.log"; do
+	kill -0 $SERVER_PID 2>/dev/null || { cat "$WORK/server.log" >&2; exit 1; }
+	sleep 0.1
+done
+ADDRESS=$(sed -n 's/^listening on //p' "$WORK/server.log")
+
+# fetch
+if ! BUILDSDB_STATUS_URL="http://$ADDRESS" BUILDSDB_DATABASE="$WORK/builds.sqlite" BUILDSDB_METRICS_PROM="$WORK/metrics.prom" \
+	$BUILDSDB fetch > "$WORK/fetch.log" 2>&1; then
+	echo "warning: the fetch has failed, the last lines of its log:" >&2
+	tail -n 20 "$WORK/fetch.log" >&2
+fi
+[ -f "$WORK/metrics.prom" ] || exit 1
+
+# report
+awk '
+	!/^#/ { m[$1] = $2 }
+	END {
+		wall = m["buildsdb_fetch_wall_seconds"]
+		mib = 1024*1024
+		printf("requests:   %d (%.1f req/s), %d not modified, %d retried, %d failed\n", m["buildsdb_fetch_requests"], m["buildsdb_fetch_requests"]/wall, m["buildsdb_fetch_waived"], m["buildsdb_fetch_retries"], m["buildsdb_fetch_errors"])
+		printf("received:   %.1f MiB on the wire (%.1f MiB/s), %.1f MiB decoded\n", m["buildsdb_fetch_bytes_on_wire"]/mib, m["buildsdb_fetch_bytes_on_wire"]/mib/wall, m["buildsdb_fetch_bytes_decoded"]/mib)
+		printf("written:    %d build(s), %d row(s)\n", m["buildsdb_write_builds"], m["buildsdb_write_rows"])
+		printf("wall time:  %.3f sec\n", wall)
+		printf("peak RSS:   %.1f MiB\n", m["buildsdb_fetch_max_rss_bytes"]/mib)
+	}
+' "$WORK/metrics.prom"
@@ -0,0 +1,408 @@
+// Copyright (C) 2024 by Yuri Victorovich. All rights reserved.
+
+//
+// gen-dataset: generates a synthetic corpus in the layout of pkg-status.freebsd.org for scale testing,
+// to be served by bench/mock-server and fetched into a database
+//
+// Ports form a dependency DAG where popular ports are depended upon by many others. Each masterbuild keeps a set of
+// broken ports that persists across its builds, a broken port fails, and the ports that depend on a failed or ignored
+// port are skipped with the package that has caused the skip in skipped.depends. Elapsed times are log-normal.
+//
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <time.h>
+
+namespace fs = std::filesystem;
+
+#define STR(msg...) ([&]() {std::ostringstream ss; ss << msg; return ss.str();}())
+#define PRINT(msg...) std::cout << msg << std::endl;
+#define FAIL(msg...) {std::cerr << "gen-dataset: " << msg << std::endl; ::exit(EXIT_FAILURE);}
+
+typedef uint64_t Time;
+
+struct Options {
+	std::string   output;
+	unsigned      numServers = 2;
+	unsigned      numMasterbuilds = 4; // per server
+	unsigned      numBuilds = 5; // per masterbuild
+	unsigned      numRunning = 1; // builds in progress at the end of each masterbuild
+	unsigned      numPorts = 30000;
+	double        brokenPercent = 0.2; // ports that become broken in a build
+	double        fixedPercent = 20; // broken ports that get fixed in a build
+	double        ignoredPercent = 2.5;
+	double        avgDepends = 3; // average number of direct dependencies
+	unsigned      buildIntervalHours = 48;
+	unsigned      jobs = 16; // parallel builders, for the duration of builds
+	unsigned      seed = 1;
+};
+
+static Options options;
+static std::mt19937_64 random64;
+
+static double uniform() {
+	return std::uniform_real_distribution<double>(0, 1)(random64);
+}
+
+static bool chance(double percent) {
+	return uniform()*100 < percent;
+}
+
+template<typename T>
+static const T& pick(const std::vector<T> &v) {
+	return v[random64() % v.size()];
+}
+
+static Time elapsed(double medianSeconds) { // log-normal: most ports build quickly, a few take hours
+	auto t = std::exp(std::log(medianSeconds) + 1.4*std::normal_distribution<double>(0, 1)(random64));
+	return Time(std::clamp(t, 1.0, 86400.0));
+}
+
+static std::string hex(uint64_t val, unsigned digits) {
+	return STR(std::hex << std::setw(digits) << std::setfill('0') << (val & ((uint64_t(1) << (4*digits)) - 1)));
+}
+
+//
+// ports
+//
+
+struct Port {
+	std::string             origin;
+	std::string             pkgname;
+	std::vector<unsigned>   depends; // ports with smaller indexes, so the index order is a build order
+	double                  weight = 1; // of breakage: ports that many others depend upon are kept in a good shape
+};
+
+static std::vector<Port> generatePorts() {
+	static const std::vector<std::string> categories = {
+		"archivers", "audio", "benchmarks", "biology", "cad", "comms", "converters", "databases", "deskutils", "devel",
+		"dns", "editors", "emulators", "finance", "ftp", "games", "graphics", "irc", "japanese", "java", "lang", "mail",
+		"math", "misc", "multimedia", "net", "net-im", "net-mgmt", "news", "print", "science", "security", "shells",
+		"sysutils", "textproc", "www", "x11", "x11-fonts", "x11-toolkits", "x11-wm"
+	};
+	static const std::vector<std::string> syllables = {
+		"ba", "co", "de", "fi", "gu", "ka", "li", "mo", "nu", "pa", "qi", "ro", "su", "te", "vi", "xo", "ya", "ze", "lib", "py"
+	};
+
+	std::vector<Port> ports(options.numPorts);
+	for (unsigned i = 0; i < ports.size(); i++) {
+		auto &port = ports[i];
+		std::string name;
+		for (unsigned n = 2 + random64() % 3; n > 0; n--)
+			name += pick(syllables);
+		name += std::to_string(i);
+		port.origin = pick(categories) + "/" + name;
+		port.pkgname = STR(name << "-" << 1 + random64() % 9 << "." << random64() % 20 << "." << random64() % 10);
+
+		// dependencies are biased towards the ports with small indexes: they are the popular ones
+		if (i > 0) {
+			auto num = std::poisson_distribution<unsigned>(options.avgDepends)(random64);
+			for (unsigned d = 0; d < num; d++)
+				port.depends.push_back(unsigned(i*std::pow(uniform(), 3)));
+			std::sort(port.depends.begin(), port.depends.end());
+			port.depends.erase(std::unique(port.depends.begin(), port.depends.end()), port.depends.end());
+		}
+	}
+
+	// weights, the average weight is 1 so that the percentages hold
+	std::vector<unsigned> numDependents(ports.size(), 0);
+	for (auto &port : ports)
+		for (auto d : port.depends)
+			numDependents[d]++;
+	double sum = 0;
+	for (unsigned i = 0; i < ports.size(); i++)
+		sum += ports[i].weight = 1.0/((1 + numDependents[i])*(1 + numDependents[i]));
+	for (auto &port : ports)
+		port.weight *= ports.size()/sum;
+	return ports;
+}
+
+//
+// JSON output
+//
+
+static void writeString(std::ostream &os, const std::string &str) {
+	os << '"';
+	for (auto chr : str)
+		if (chr == '"' || chr == '\\')
+			os << '\\' << chr;
+		else if ((unsigned char)chr < 0x20)
+			os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << unsigned(chr) << std::dec;
+		else
+			os << chr;
+	os << '"';
+}
+
+static void writeFile(const fs::path &path, const std::string &content) {
+	fs::create_directories(path.parent_path());
+	std::ofstream file(path, std::ios::binary);
+	file << content;
+	if (!file)
+		FAIL("failed to write the file " << path)
+}
+
+//
+// builds
+//
+
+enum Outcome {NotDone, Built, Failed, Ignored, Skipped};
+
+struct Build {
+	std::string   name;
+	Time          started;
+	Time          ended; // 0 while running
+	std::string   status;
+};
+
+struct Totals {
+	uint64_t   numBuilds = 0;
+	uint64_t   numRecords = 0;
+	uint64_t   bytes = 0;
+};
+
+static Build generateBuild(const fs::path &dir, const std::string &mastername, const std::string &jailname, const std::string &buildname,
+                           Time started, bool running, const std::vector<Port> &ports, std::vector<bool> &broken, std::vector<bool> &ignored, Totals &totals) {
+	static const std::vector<std::string> phases = {"build", "build", "build", "configure", "stage", "package", "check-plist", "fetch", "run-depends"};
+	static const std::vector<std::string> errortypes = {
+		"compiler_error", "compiler_error", "configure_error", "linker_error", "makefile", "missing_dependency",
+		"plist", "runaway_process", "stage", "fetch", "checksum", "clang-bug"
+	};
+	static const std::vector<std::string> ignoredReasons = {
+		"is marked as broken: fails to build", "is only for amd64", "has a known vulnerability", "is forbidden: license restrictions"
+	};
+
+	// broken ports change between builds
+	for (unsigned i = 0; i < ports.size(); i++)
+		if (broken[i] ? chance(options.fixedPercent) : chance(options.brokenPercent*ports[i].weight))
+			broken[i] = !broken[i];
+
+	// outcomes in the build order, a running build has only processed a part of the ports
+	auto numDone = running ? unsigned(ports.size()*(0.1 + 0.8*uniform())) : unsigned(ports.size());
+	std::vector<Outcome> outcomes(ports.size(), NotDone);
+	std::vector<unsigned> cause(ports.size()); // the failed or ignored port that has caused the skip
+	std::vector<Time> elapsedTimes(ports.size(), 0);
+	Time totalElapsed = 0;
+	for (unsigned i = 0; i < numDone; i++) {
+		auto &outcome = outcomes[i];
+		for (auto d : ports[i].depends)
+			if (outcomes[d] == Failed || outcomes[d] == Ignored || outcomes[d] == Skipped) {
+				outcome = Skipped;
+				cause[i] = outcomes[d] == Skipped ? cause[d] : d;
+				break;
+			}
+		if (outcome == Skipped)
+			continue;
+		if (ignored[i]) {
+			outcome = Ignored;
+		} else {
+			outcome = broken[i] ? Failed : Built;
+			elapsedTimes[i] = elapsed(outcome == Built ? 60 : 30);
+			totalElapsed += elapsedTimes[i];
+		}
+	}
+
+	// the document
+	Build build{buildname, started, 0, "parallel_build:"};
+	if (!running) {
+		build.ended = started + std::max<Time>(totalElapsed/options.jobs, 60);
+		build.status = "stopped:done:";
+	}
+	std::ostringstream os;
+	os << "{\"mastername\":";
+	writeString(os, mastername);
+	os << ",\"buildname\":";
+	writeString(os, buildname);
+	os << ",\"jailname\":";
+	writeString(os, jailname);
+	os << ",\"status\":";
+	writeString(os, build.status);
+	os << ",\"started\":\"" << build.started << "\"";
+	if (build.ended != 0)
+		os << ",\"ended\":\"" << build.ended << "\"";
+	unsigned counts[5] = {0, 0, 0, 0, 0};
+	for (auto outcome : outcomes)
+		counts[outcome]++;
+	os << ",\"stats\":{\"queued\":\"" << ports.size() << "\",\"built\":\"" << counts[Built] << "\",\"failed\":\"" << counts[Failed]
+	   << "\",\"ignored\":\"" << counts[Ignored] << "\",\"skipped\":\"" << counts[Skipped] << "\"}";
+	os << ",\"ports\":{\"tobuild\":[]";
+	auto section = [&](const char *name, Outcome which, std::function<void(unsigned)> fields) {
+		os << ",\"" << name << "\":[";
+		bool first = true;
+		for (unsigned i = 0; i < ports.size(); i++)
+			if (outcomes[i] == which || which == NotDone) {
+				os << (first ? "{" : ",{") << "\"origin\":";
+				writeString(os, ports[i].origin);
+				os << ",\"pkgname\":";
+				writeString(os, ports[i].pkgname);
+				fields(i);
+				os << "}";
+				first = false;
+				totals.numRecords++;
+			}
+		os << "]";
+	};
+	section("queued", NotDone, [&](unsigned) {
+		os << ",\"reason\":\"listed\"";
+	});
+	section("built", Built, [&](unsigned i) {
+		os << ",\"elapsed\":\"" << elapsedTimes[i] << "\"";
+	});
+	section("failed", Failed, [&](unsigned i) {
+		os << ",\"phase\":\"" << pick(phases) << "\",\"errortype\":\"" << pick(errortypes) << "\",\"elapsed\":\"" << elapsedTimes[i] << "\"";
+	});
+	section("ignored", Ignored, [&](unsigned) {
+		os << ",\"reason\":";
+		writeString(os, pick(ignoredReasons));
+	});
+	section("skipped", Skipped, [&](unsigned i) {
+		os << ",\"depends\":";
+		writeString(os, ports[cause[i]].pkgname);
+	});
+	os << "}}";
+
+	auto content = os.str();
+	writeFile(dir / buildname / ".data.json", content);
+	totals.numBuilds++;
+	totals.bytes += content.size();
+	return build;
+}
+
+//
+// main
+//
+
+static int usage() {
+	std::cerr << "usage: gen-dataset --output {dir} [--servers {n}] [--masterbuilds {n per server}] [--builds {n per masterbuild}]" << std::endl;
+	std::cerr << "                   [--running {n per masterbuild}] [--ports {n}] [--broken-percent {p}] [--fixed-percent {p}]" << std::endl;
+	std::cerr << "                   [--ignored-percent {p}] [--avg-depends {n}] [--build-interval {hours}] [--jobs {n}] [--seed {n}]" << std::endl;
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+	// arguments
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		if (a + 1 == argc)
+			return usage();
+		std::string val = argv[++a];
+		if (arg == "--output")
+			options.output = val;
+		else if (arg == "--servers")
+			options.numServers = std::stoul(val);
+		else if (arg == "--masterbuilds")
+			options.numMasterbuilds = std::stoul(val);
+		else if (arg == "--builds")
+			options.numBuilds = std::stoul(val);
+		else if (arg == "--running")
+			options.numRunning = std::stoul(val);
+		else if (arg == "--ports")
+			options.numPorts = std::stoul(val);
+		else if (arg == "--broken-percent")
+			options.brokenPercent = std::stod(val);
+		else if (arg == "--fixed-percent")
+			options.fixedPercent = std::stod(val);
+		else if (arg == "--ignored-percent")
+			options.ignoredPercent = std::stod(val);
+		else if (arg == "--avg-depends")
+			options.avgDepends = std::stod(val);
+		else if (arg == "--build-interval")
+			options.buildIntervalHours = std::stoul(val);
+		else if (arg == "--jobs")
+			options.jobs = std::max(1ul, std::stoul(val));
+		else if (arg == "--seed")
+			options.seed = std::stoul(val);
+		else
+			return usage();
+	}
+	if (options.output.empty() || options.numServers == 0 || options.numMasterbuilds == 0 || options.numBuilds == 0 || options.numPorts == 0)
+		return usage();
+	random64.seed(options.seed);
+
+	static const std::vector<std::string> branches = {"main", "142", "141", "134"};
+	static const std::vector<std::string> arches = {"amd64", "i386", "arm64", "armv7", "powerpc64le"};
+	static const std::vector<std::string> sets = {"default", "quarterly"};
+
+	auto ports = generatePorts();
+	fs::path root(options.output);
+	auto now = Time(::time(nullptr));
+	auto interval = Time(options.buildIntervalHours)*60*60;
+	Totals totals;
+	std::ostringstream api; // api/1/builds
+	api << "{\"builds\":[";
+	bool firstApi = true;
+	unsigned masterbuildNo = 0;
+
+	for (unsigned s = 0; s < options.numServers; s++) {
+		auto server = STR("beefy" << s + 1);
+		std::ostringstream serverIndex;
+		serverIndex << "{\"masternames\":{";
+
+		for (unsigned m = 0; m < options.numMasterbuilds; m++, masterbuildNo++) {
+			// names are unique across servers
+			auto combo = masterbuildNo % (branches.size()*arches.size()*sets.size());
+			auto &branch = branches[combo % branches.size()];
+			auto jailname = STR(branch << (branch == "main" ? "-" : "") << arches[combo/branches.size() % arches.size()]);
+			auto mastername = STR(jailname << "-" << sets[combo/(branches.size()*arches.size())]);
+			if (masterbuildNo >= branches.size()*arches.size()*sets.size())
+				mastername += STR("-" << masterbuildNo);
+			auto dir = root / server / "data" / mastername;
+
+			// per-masterbuild state: ignored ports are stable, broken ones come and go, starting from the steady state
+			std::vector<bool> broken(ports.size(), false), ignored(ports.size(), false);
+			auto steadyBrokenPercent = 100*options.brokenPercent/(options.brokenPercent + options.fixedPercent);
+			for (unsigned i = 0; i < ports.size(); i++) {
+				broken[i] = chance(steadyBrokenPercent*ports[i].weight);
+				ignored[i] = chance(options.ignoredPercent*ports[i].weight);
+			}
+
+			std::ostringstream summaries;
+			summaries << "{\"builds\":{";
+			Build latest;
+			for (unsigned b = 0; b < options.numBuilds; b++) {
+				auto started = now - Time(options.numBuilds - b)*interval + random64() % (interval/4 + 1);
+				auto buildname = STR("p" << hex(random64(), 10) << "_s" << hex(random64(), 10));
+				auto running = b + options.numRunning >= options.numBuilds;
+				latest = generateBuild(dir, mastername, jailname, buildname, started, running, ports, broken, ignored, totals);
+
+				summaries << "\"" << buildname << "\":{\"buildname\":\"" << buildname << "\",\"jailname\":\"" << jailname << "\",\"started\":\"" << started << "\"";
+				if (latest.ended != 0)
+					summaries << ",\"ended\":\"" << latest.ended << "\"";
+				summaries << ",\"status\":\"" << latest.status << "\"},";
+
+				api << (firstApi ? "" : ",") << "{\"server\":\"" << server << "\",\"mastername\":\"" << mastername << "\",\"buildname\":\"" << buildname << "\",\"started\":" << started << "}";
+				firstApi = false;
+			}
+			summaries << "\"latest\":{\"buildname\":\"" << latest.name << "\",\"status\":\"" << latest.status << "\"}}}";
+			writeFile(dir / ".data.json", summaries.str());
+
+			serverIndex << (m > 0 ? "," : "") << "\"" << mastername << "\":{\"latest\":{\"buildname\":\"" << latest.name << "\"}}";
+			PRINT("generated " << server << "/" << mastername << ": " << options.numBuilds << " build(s)")
+		}
+
+		serverIndex << "}}";
+		writeFile(root / server / "data" / ".data.json", serverIndex.str());
+	}
+
+	api << "]}";
+	writeFile(root / "api" / "1" / "builds", api.str());
+
+	PRINT(
+		"generated " << options.numServers << " server(s), " << options.numServers*options.numMasterbuilds << " masterbuild(s), "
+		<< totals.numBuilds << " build(s) with " << totals.numRecords << " record(s), "
+		<< std::fixed << std::setprecision(1) << double(totals.bytes)/(1024*1024) << " MiB in " << options.output
+	)
+
+	return EXIT_SUCCESS;
+}
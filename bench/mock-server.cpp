@@ -0,0 +1,295 @@
+// Copyright (C) 2024 by Yuri Victorovich. All rights reserved.
+
+//
+// mock-server: loopback HTTP server that serves a corpus directory in the layout of pkg-status.freebsd.org,
+// i.e. api/1/builds, {server}/data/.data.json, {server}/data/{masterbuild}/.data.json and
+// {server}/data/{masterbuild}/{build}/.data.json, with configurable latency, bandwidth, Last-Modified and errors
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+#define STR(msg...) ([&]() {std::ostringstream ss; ss << msg; return ss.str();}())
+#define PRINT(msg...) std::cout << msg << std::endl;
+#define FAIL(msg...) {std::cerr << "mock-server: " << msg << std::endl; ::exit(EXIT_FAILURE);}
+
+enum LastModified {LastModifiedMtime, LastModifiedNow, LastModifiedNone};
+
+struct Options {
+	std::string    root;
+	unsigned       port = 18080; // 0 picks a free port
+	unsigned       latencyMs = 0; // before each response
+	unsigned       bandwidthKiB = 0; // per connection, 0 is unlimited
+	LastModified   lastModified = LastModifiedMtime;
+	double         errorRate = 0; // percentage of requests that fail
+	unsigned       errorStatus = 503;
+	unsigned       seed = 1;
+};
+
+static Options options;
+
+// statistics
+static std::atomic<uint64_t> numRequests{0};
+static std::atomic<uint64_t> numNotModified{0};
+static std::atomic<uint64_t> numErrors{0};
+static std::atomic<uint64_t> bytesSent{0};
+
+static std::string httpDate(time_t t) {
+	struct tm tm;
+	char buf[64];
+	::gmtime_r(&t, &tm);
+	::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return buf;
+}
+
+static time_t parseHttpDate(const std::string &str) { // 0 when it can't be parsed
+	struct tm tm;
+	std::memset(&tm, 0, sizeof(tm));
+	if (!::strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return 0;
+	return ::timegm(&tm);
+}
+
+static bool injectError() {
+	static std::mutex mutex;
+	static std::mt19937 random(options.seed);
+	if (options.errorRate <= 0)
+		return false;
+	std::lock_guard<std::mutex> guard(mutex);
+	return std::uniform_real_distribution<double>(0, 100)(random) < options.errorRate;
+}
+
+static bool sendAll(int fd, const char *data, size_t size) { // throttled to the bandwidth
+	auto started = std::chrono::steady_clock::now();
+	size_t sent = 0;
+	while (sent < size) {
+		size_t chunk = size - sent;
+		if (options.bandwidthKiB > 0) {
+			chunk = std::min<size_t>(chunk, 16*1024);
+			auto due = started + std::chrono::microseconds(uint64_t(sent)*1000000/(uint64_t(options.bandwidthKiB)*1024));
+			std::this_thread::sleep_until(due);
+		}
+		auto n = ::send(fd, data + sent, chunk, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+		sent += n;
+	}
+	bytesSent += size;
+	return true;
+}
+
+static bool respond(int fd, unsigned status, const char *reason, const std::string &headers, const std::string &body, bool head) {
+	auto response = STR(
+		"HTTP/1.1 " << status << " " << reason << "\r\n"
+		<< "Server: buildsdb-mock-server\r\n"
+		<< "Date: " << httpDate(::time(nullptr)) << "\r\n"
+		<< "Content-Length: " << body.size() << "\r\n"
+		<< headers
+		<< "\r\n"
+	);
+	if (!head)
+		response += body;
+	return sendAll(fd, response.data(), response.size());
+}
+
+static bool serveRequest(int fd, const std::string &method, const std::string &target, const std::string &ifModifiedSince) {
+	numRequests++;
+
+	// latency
+	if (options.latencyMs > 0)
+		std::this_thread::sleep_for(std::chrono::milliseconds(options.latencyMs));
+
+	// checks
+	bool head = method == "HEAD";
+	if (method != "GET" && !head)
+		return respond(fd, 405, "Method Not Allowed", "", "", false);
+	if (injectError()) {
+		numErrors++;
+		return respond(fd, options.errorStatus, "Injected Error", "", "injected error\n", head);
+	}
+
+	// map the path to a file, the query string is ignored
+	auto path = target.substr(0, target.find('?'));
+	if (path.empty() || path[0] != '/' || path.find("..") != std::string::npos)
+		return respond(fd, 400, "Bad Request", "", "", head);
+	auto fileName = options.root + path;
+	struct stat st;
+	if (::stat(fileName.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		return respond(fd, 404, "Not Found", "", "<html>not found</html>\n", head);
+
+	// Last-Modified
+	std::string headers = "Content-Type: application/json\r\n";
+	time_t lastModified = 0;
+	switch (options.lastModified) {
+	case LastModifiedMtime:
+		lastModified = st.st_mtime;
+		break;
+	case LastModifiedNow: // the server bumps Last-Modified on every request even though the content is the same
+		lastModified = ::time(nullptr);
+		break;
+	case LastModifiedNone:
+		break;
+	}
+	if (lastModified != 0) {
+		headers += STR("Last-Modified: " << httpDate(lastModified) << "\r\n");
+		auto since = ifModifiedSince.empty() ? 0 : parseHttpDate(ifModifiedSince);
+		if (since != 0 && lastModified <= since) {
+			numNotModified++;
+			return respond(fd, 304, "Not Modified", headers, "", true/*no body*/);
+		}
+	}
+
+	// body
+	std::ifstream file(fileName, std::ios::binary);
+	std::string body((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	return respond(fd, 200, "OK", headers, body, head);
+}
+
+static void serveConnection(int fd) { // HTTP/1.1 with keep-alive
+	std::string buffer;
+	char chunk[4096];
+	while (true) {
+		// read the request head
+		size_t end;
+		while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+			auto n = ::recv(fd, chunk, sizeof(chunk), 0);
+			if (n <= 0 || buffer.size() > 64*1024) {
+				::close(fd);
+				return;
+			}
+			buffer.append(chunk, n);
+		}
+		std::istringstream head(buffer.substr(0, end));
+		buffer.erase(0, end + 4); // requests have no body
+
+		// parse it
+		std::string line, method, target, version, ifModifiedSince;
+		bool close = false;
+		std::getline(head, line);
+		std::istringstream(line) >> method >> target >> version;
+		while (std::getline(head, line)) {
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			auto colon = line.find(':');
+			if (colon == std::string::npos)
+				continue;
+			auto name = line.substr(0, colon), value = line.substr(std::min(line.find_first_not_of(' ', colon + 1), line.size()));
+			for (auto &c : name)
+				c = ::tolower(c);
+			if (name == "if-modified-since")
+				ifModifiedSince = value;
+			else if (name == "connection" && ::strcasecmp(value.c_str(), "close") == 0)
+				close = true;
+		}
+		if (version != "HTTP/1.1")
+			close = true;
+
+		// respond
+		if (!serveRequest(fd, method, target, ifModifiedSince) || close) {
+			::close(fd);
+			return;
+		}
+	}
+}
+
+static int usage() {
+	std::cerr << "usage: mock-server --root {dir} [--port {port}] [--latency {ms}] [--bandwidth {KiB/s}]" << std::endl;
+	std::cerr << "                   [--last-modified {mtime|now|none}] [--error-rate {percent}] [--error-status {code}] [--seed {n}]" << std::endl;
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+	// arguments
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		if (a + 1 == argc)
+			return usage();
+		std::string val = argv[++a];
+		if (arg == "--root")
+			options.root = val;
+		else if (arg == "--port")
+			options.port = std::stoul(val);
+		else if (arg == "--latency")
+			options.latencyMs = std::stoul(val);
+		else if (arg == "--bandwidth")
+			options.bandwidthKiB = std::stoul(val);
+		else if (arg == "--last-modified" && (val == "mtime" || val == "now" || val == "none"))
+			options.lastModified = val == "mtime" ? LastModifiedMtime : val == "now" ? LastModifiedNow : LastModifiedNone;
+		else if (arg == "--error-rate")
+			options.errorRate = std::stod(val);
+		else if (arg == "--error-status")
+			options.errorStatus = std::stoul(val);
+		else if (arg == "--seed")
+			options.seed = std::stoul(val);
+		else
+			return usage();
+	}
+	if (options.root.empty())
+		return usage();
+	if (!fs::is_directory(options.root))
+		FAIL("the corpus directory " << options.root << " doesn't exist")
+
+	// signals are only handled by the main thread
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	// listen on the loopback interface
+	int listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+	if (listenFd < 0)
+		FAIL("failed to create a socket: " << ::strerror(errno))
+	int one = 1;
+	::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(options.port);
+	if (::bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listenFd, 128) != 0)
+		FAIL("failed to listen on the port " << options.port << ": " << ::strerror(errno))
+	socklen_t addrLen = sizeof(addr);
+	::getsockname(listenFd, (struct sockaddr*)&addr, &addrLen);
+	PRINT("listening on 127.0.0.1:" << ntohs(addr.sin_port))
+
+	// accept connections, each is served by its own thread
+	std::thread([listenFd]() {
+		while (true) {
+			int fd = ::accept(listenFd, nullptr, nullptr);
+			if (fd >= 0)
+				std::thread(serveConnection, fd).detach();
+		}
+	}).detach();
+
+	// wait for a signal, and report
+	int sig;
+	sigwait(&signals, &sig);
+	PRINT("served " << numRequests << " request(s), " << numNotModified << " not modified, " << numErrors << " injected error(s), " << bytesSent << " bytes")
+
+	return EXIT_SUCCESS;
+}
@@ -3,34 +3,50 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <iomanip>
 #include <iostream>
 #include <fstream>
 #include <filesystem>
 #include <functional>
+#include <future>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <ostream>
+#include <random>
 #include <set>
 #include <stdexcept>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <curl/curl.h>
 #include <nlohmann/json.hpp>
+#include <sqlite3.h>
 #include <SQLiteCpp/Database.h>
 #include <SQLiteCpp/Statement.h>
 #include <SQLiteCpp/Transaction.h>
 #include <taskflow/taskflow.hpp>
+#include <zlib.h>
 
 // type shortcuts
 using json = nlohmann::json;
@@ -59,7 +75,8 @@ namespace fs = std::filesystem;
 #define FAIL(msg...) throw std::runtime_error(__STR__(msg));
 #define SQL_STMT(var, sql) \
 	static SQLite::Statement var(db, sql); \
-	var.reset();
+	var.reset(); \
+	var.clearBindings(); // unbound parameters are NULL, not the values from the previous execution
 
 #define MSG(msg...)     PRINT(timestamp() << ": " << msg) // user message
 #define WARNING(msg...) MSG("warning: " << msg)
@@ -70,12 +87,15 @@ namespace fs = std::filesystem;
 //
 
 enum YesNoAny {Yes, No, Any};
+enum OutputFormat {FormatTable, FormatJsonLines, FormatCsv, FormatTsv};
 
 //
 // extern declarations
 //
 
 extern const char *dbSchema;
+extern const char *dbSchemaIndexes;
+extern const char *dbSchemaUpgrades[];
 
 //
 // global variables
@@ -106,10 +126,6 @@ static std::string timestamp() {
 
 }
 
-static bool contains(const std::string &str, char chr) {
-	return str.find(chr) != std::string::npos;
-}
-
 static bool contains(const std::string &str, const char *small) {
 	return str.find(small) != std::string::npos;
 }
@@ -122,33 +138,9 @@ static bool equals(const char *str, const char *other) {
 	return ::strcmp(str, other) == 0;
 }
 
-static std::string execCommand(const char* cmd) {
-	std::string result;
-	std::array<char, 128> buffer;
-	FILE *pipe = ::popen(cmd, "r");
-	if (!pipe)
-		throw std::runtime_error("popen() failed to execute the command");
-
-	// read the output
-	while (fgets(buffer.data(), buffer.size(), pipe) != nullptr)
-        	result += buffer.data();
-
-	// close the pipe and check process exit code
-	if (WEXITSTATUS(::pclose(pipe)) != EXIT_SUCCESS)
-		FAIL("the external process has failed")
-
-	return result;
-}
-
-static std::vector<std::string> splitString(const std::string &str, char sep) {
-	std::vector<std::string> v;
-	std::string parsed;
-	std::stringstream is(str);
-
-	while (std::getline(is, parsed, sep))
-		v.push_back(parsed);
-
-	return v;
+static unsigned envUnsigned(const char *name, unsigned def) {
+	auto val = ::getenv(name);
+	return val && *val ? (unsigned)std::stoul(val) : def;
 }
 
 static size_t writeData(void *ptr, size_t size, size_t nmemb, std::string *str) {
@@ -163,6 +155,66 @@ static size_t writeData(void *ptr, size_t size, size_t nmemb, std::string *str)
 	return nmemb;
 }
 
+static std::string formatBytes(uint64_t bytes) {
+	std::ostringstream ss;
+	ss.precision(1);
+	ss << std::fixed;
+	if (bytes >= 1024*1024*1024)
+		ss << double(bytes)/(1024*1024*1024) << " GiB";
+	else if (bytes >= 1024*1024)
+		ss << double(bytes)/(1024*1024) << " MiB";
+	else if (bytes >= 1024)
+		ss << double(bytes)/1024 << " KiB";
+	else
+		ss << bytes << " bytes";
+	return ss.str();
+}
+
+static uint64_t xxh64(const std::string &str, uint64_t seed = 0) { // XXH64 hash of the content, the same as the xxHash library computes
+	const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL,
+	               P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+	auto rotl = [](uint64_t x, int r) {return (x << r) | (x >> (64 - r));};
+	auto read64 = [](const char *p) {uint64_t v; std::memcpy(&v, p, 8); return v;}; // little endian
+	auto read32 = [](const char *p) {uint32_t v; std::memcpy(&v, p, 4); return uint64_t(v);};
+	auto round = [&rotl,P1,P2](uint64_t acc, uint64_t input) {return rotl(acc + input*P2, 31)*P1;};
+	auto merge = [&round,P1,P4](uint64_t acc, uint64_t val) {return (acc ^ round(0, val))*P1 + P4;};
+
+	const char *p = str.data(), *end = p + str.size();
+	uint64_t h;
+	if (str.size() >= 32) {
+		uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+		for (; p + 32 <= end; p += 32) {
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+	} else {
+		h = seed + P5;
+	}
+	h += str.size();
+	for (; p + 8 <= end; p += 8)
+		h = rotl(h ^ round(0, read64(p)), 27)*P1 + P4;
+	if (p + 4 <= end) {
+		h = rotl(h ^ read32(p)*P1, 23)*P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		h = rotl(h ^ uint8_t(*p)*P5, 11)*P1;
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+static std::string formatHash(uint64_t hash) {
+	return STR(std::hex << std::setw(16) << std::setfill('0') << hash);
+}
+
 static void writeFile(const std::string &fileName, const std::string &content) {
 	std::ofstream myfile;
 	myfile.open(fileName);
@@ -170,111 +222,854 @@ static void writeFile(const std::string &fileName, const std::string &content) {
 	myfile.close();
 }
 
-static std::tuple<bool/*waived*/,std::string/*content*/> fetchDataFromURL(
-	const std::string &url,
-	const std::string *knownLastModified = nullptr,
-	std::string *needLastModified = nullptr
-) {
-	// helpers
-	auto getOneHeader = [&url](CURL *curl, const char *header_name) -> std::string {
-		struct curl_header *prev = nullptr;
-		while (auto h = curl_easy_nextheader(curl, CURLH_HEADER, 0, prev)) {
-			if (equals(h->name, header_name)) {
-				return h->value;
-			}
-			prev = h;
+static void dumpDownloadedFile(const std::string &url, const std::string &content) {
+	static unsigned fileNo = 1;
+
+	// generate debug file number
+	unsigned fno;
+	{
+		static std::mutex mutex;
+		std::lock_guard<std::mutex> guard(mutex);
+		fno = fileNo++;
+	}
+
+	// write debug files
+	writeFile(STR("debug." << fno << ".url.txt"), url);
+	writeFile(STR("debug." << fno << ".content.json"), content);
+}
+
+//
+// metrics
+//
+
+struct Histogram { // distribution of durations in seconds with cumulative buckets, like Prometheus histograms
+	static constexpr std::array<double, 14> bounds{0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+
+	std::array<uint64_t, bounds.size()>   buckets{}; // observations <= bound
+	uint64_t                              count = 0;
+	double                                sum = 0;
+	double                                max = 0;
+
+	void observe(double seconds) {
+		for (unsigned b = 0; b < bounds.size(); b++)
+			if (seconds <= bounds[b])
+				buckets[b]++;
+		count++;
+		sum += seconds;
+		max = std::max(max, seconds);
+	}
+
+	json toJson() const {
+		json j = {{"count", count}, {"sum", sum}, {"max", max}, {"buckets", json::array()}};
+		for (unsigned b = 0; b < bounds.size(); b++)
+			j["buckets"].push_back({{"le", bounds[b]}, {"count", buckets[b]}});
+		return j;
+	}
+
+	void writePrometheus(std::ostream &os, const std::string &name, const std::string &help) const {
+		os << "# HELP " << name << " " << help << std::endl;
+		os << "# TYPE " << name << " histogram" << std::endl;
+		for (unsigned b = 0; b < bounds.size(); b++)
+			os << name << "_bucket{le=\"" << bounds[b] << "\"} " << buckets[b] << std::endl;
+		os << name << "_bucket{le=\"+Inf\"} " << count << std::endl;
+		os << name << "_sum " << sum << std::endl;
+		os << name << "_count " << count << std::endl;
+	}
+};
+
+static uint64_t maxRssBytes() {
+	struct rusage ru;
+	::getrusage(RUSAGE_SELF, &ru);
+	return uint64_t(ru.ru_maxrss)*1024; // in KiB on FreeBSD and Linux
+}
+
+//
+// trace: timeline of the fetch in the Chrome trace-event format (viewable in Perfetto or chrome://tracing),
+// recorded while a Trace object exists, which happens when BUILDSDB_TRACE names the output file
+//
+
+struct Trace {
+	typedef std::vector<std::pair<const char*, std::string>> Args;
+
+	Trace(const char *path_)
+	: path(path_ ? path_ : "")
+	, started(std::chrono::steady_clock::now())
+	{
+		if (path.empty())
+			return;
+		std::lock_guard<std::mutex> guard(threadNamesMutex);
+		addThreadName(std::this_thread::get_id(), "main");
+		for (auto &t : threadNames) // threads that were started before the trace
+			addThreadName(t.first, t.second);
+		active = this;
+	}
+	~Trace() {
+		Trace *self = this;
+		if (!active.compare_exchange_strong(self, nullptr))
+			return;
+		try {
+			write();
+			MSG("wrote the trace with " << events.size() << " event(s) to " << path)
+		} catch (std::exception &e) {
+			WARNING("failed to write the trace to " << path << ": " << e.what())
+		}
+	}
+
+	static Trace* get() { // nullptr when not tracing
+		return active;
+	}
+
+	struct ThreadName { // names the current thread while it exists, in the current trace and in the traces started later
+		ThreadName(const char *name) {
+			std::lock_guard<std::mutex> guard(threadNamesMutex);
+			threadNames[std::this_thread::get_id()] = name;
+			if (auto trace = get())
+				trace->addThreadName(std::this_thread::get_id(), name);
+		}
+		~ThreadName() {
+			std::lock_guard<std::mutex> guard(threadNamesMutex);
+			threadNames.erase(std::this_thread::get_id());
 		}
-		WARNING("no " << header_name << " field is present in the server response (for URL=" << url << ")")
-		return "";
 	};
 
-	// run
-	if (auto curl = curl_easy_init()) {
-		// set general options
-		if (::getenv("HTTP_PROXY"))
-			curl_easy_setopt(curl, CURLOPT_PROXY, ::getenv("HTTP_PROXY")); // ex. "socks5://localhost:9050"
-		curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	// complete event: an interval on the current thread
+	void complete(const char *name, const char *cat, std::chrono::steady_clock::time_point begin, Args &&args) {
+		auto now = std::chrono::steady_clock::now();
+		add({'X', name, cat, micros(begin), micros(now) - micros(begin), 0, std::move(args)});
+	}
+
+	// async events: intervals that don't nest on the thread that starts or ends them
+	void asyncBegin(const char *name, const char *cat, uint64_t id, Args &&args) {
+		add({'b', name, cat, micros(std::chrono::steady_clock::now()), 0, id, std::move(args)});
+	}
+	void asyncEnd(const char *name, const char *cat, uint64_t id, Args &&args) {
+		add({'e', name, cat, micros(std::chrono::steady_clock::now()), 0, id, std::move(args)});
+	}
 
-		// is same Last-Modified?
-		if (knownLastModified && !knownLastModified->empty()) {
-			// set options for the HEADER request
-			curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+private:
+	struct Event {
+		char          ph;
+		const char    *name;
+		const char    *cat;
+		int64_t       ts; // in microseconds since the trace has started
+		int64_t       dur;
+		uint64_t      id;
+		Args          args;
+		unsigned      tid = 0;
+	};
 
-			// perform the HEADER request
-			curl_easy_perform(curl);
+	static inline std::atomic<Trace*>                      active{nullptr}; // written by the thread that creates the trace, read by all threads
+	static inline std::mutex                               threadNamesMutex;
+	static inline std::map<std::thread::id, const char*>   threadNames; // protected by threadNamesMutex
+	const std::string                                      path;
+	const std::chrono::steady_clock::time_point            started;
+	std::mutex                                             mutex;
+	std::vector<Event>                                     events;   // protected by mutex
+	std::map<std::thread::id, unsigned>                    threadIds; // protected by mutex
+
+	int64_t micros(std::chrono::steady_clock::time_point tm) const {
+		return std::chrono::duration_cast<std::chrono::microseconds>(tm - started).count();
+	}
 
-			// get the header
-			auto newLastModified = getOneHeader(curl, "Last-Modified");
+	void add(Event &&event, std::thread::id thread = std::this_thread::get_id()) {
+		std::lock_guard<std::mutex> guard(mutex);
+		auto i = threadIds.emplace(thread, threadIds.size() + 1).first;
+		event.tid = i->second;
+		events.push_back(std::move(event));
+	}
 
-			// restore options
-			curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+	void addThreadName(std::thread::id thread, const char *name) {
+		add({'M', "thread_name", "", 0, 0, 0, {{"name", name}}}, thread);
+	}
 
-			// see if it is the same
-			if (!newLastModified.empty() && newLastModified == *knownLastModified) {
-				curl_easy_cleanup(curl);
-				//MSG("FETCH: YES waived request for URL=" << url)
-				return {true/*waived*/, ""};
+	void write() {
+		std::ofstream file(path);
+		if (!file)
+			FAIL("can't open the file")
+		file << "{\"traceEvents\":[" << std::endl;
+		bool first = true;
+		for (auto &e : events) {
+			json j = {{"ph", std::string(1, e.ph)}, {"name", e.name}, {"pid", 1}, {"tid", e.tid}, {"ts", e.ts}};
+			if (e.cat[0])
+				j["cat"] = e.cat;
+			if (e.ph == 'X')
+				j["dur"] = e.dur;
+			if (e.ph == 'b' || e.ph == 'e')
+				j["id"] = e.id;
+			if (!e.args.empty()) {
+				j["args"] = json::object();
+				for (auto &a : e.args)
+					j["args"][a.first] = a.second;
 			}
-			//MSG("FETCH: NOT waived request for URL=" << url << ": knownLastModified=" << *knownLastModified << " != newLastModified=" << newLastModified)
+			file << (first ? "" : ",\n") << j.dump();
+			first = false;
+		}
+		file << std::endl << "]}" << std::endl;
+		if (!file)
+			FAIL("failed to write the file")
+	}
+};
+
+struct TraceSpan { // RAII complete event on the current thread, does nothing when not tracing
+	TraceSpan(const char *name_, const char *cat_, std::function<Trace::Args()> args_ = nullptr)
+	: trace(Trace::get())
+	, name(name_)
+	, cat(cat_)
+	{
+		if (trace) {
+			begin = std::chrono::steady_clock::now();
+			if (args_)
+				args = args_();
 		}
+	}
+	~TraceSpan() {
+		if (trace)
+			trace->complete(name, cat, begin, std::move(args));
+	}
 
-		// string buffer
-		std::string str;
-		str.reserve(1024*10);
+private:
+	Trace                                   *trace;
+	const char                              *name;
+	const char                              *cat;
+	std::chrono::steady_clock::time_point   begin;
+	Trace::Args                             args;
+};
 
-		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeData); // fn
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &str); // for fn
+template<typename T>
+struct BoundedQueue { // multi-producer queue, push() blocks while the queue is full
+	BoundedQueue(size_t capacity_)
+	: capacity(capacity_)
+	{ }
 
-		// run request
-		CURLcode res = curl_easy_perform(curl);
-		if (res != CURLE_OK)
-			FAIL("failed to fetch from a URL: " << curl_easy_strerror(res))
+	void push(T &&item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this]() {
+			return items.size() < capacity || closed;
+		});
+		if (closed)
+			return; // the consumer is gone
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+	}
+	bool pop(T &item) { // returns false when the queue is closed and drained
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this]() {
+			return !items.empty() || closed;
+		});
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+	void close() {
+		std::lock_guard<std::mutex> guard(mutex);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+private:
+	const size_t             capacity;
+	std::mutex               mutex;
+	std::condition_variable  notFull;
+	std::condition_variable  notEmpty;
+	std::deque<T>            items;
+	bool                     closed = false;
+};
+
+//
+// fetch engine: all HTTP requests go through one curl multi handle that is driven by its own thread,
+// so connections to the server are kept alive and reused (and multiplexed over HTTP/2 when available),
+// and no executor thread is blocked in curl while the data is in transit
+//
+
+struct FetchRequest {
+	std::string    url;
+	std::string    knownLastModified; // the request is conditional when the version already in the DB is known
+	std::string    knownETag;
+	bool           needLastModified = false; // also returns ETag
+};
+
+struct FetchResult {
+	bool           waived = false; // no need to fetch since the DB already has the same version
+	long           httpStatus = 0;
+	std::string    content;
+	std::string    lastModified;
+	std::string    etag;
+	uint64_t       bytesOnWire = 0; // body size as transferred, before the content decoding
+	std::string    error; // non-empty when the transfer has failed
+};
+
+// with BUILDSDB_CACHE_DIR, fetched responses are kept on disk: an entry per URL with Last-Modified, ETag and the hash
+// of the body, and gzipped bodies stored by their hash, so that the same body is stored once; the offline fetch replays them
+struct ResponseCache {
+	ResponseCache(const std::string &dir_)
+	: dir(dir_)
+	, queue(32)
+	{
+		fs::create_directories(dir / "urls");
+		fs::create_directories(dir / "bodies");
+
+		// responses are compressed and written in their own thread, so that the transfer thread isn't held up by them
+		thread = std::thread([this]() {
+			Trace::ThreadName threadName("cache");
+			Item item;
+			while (queue.pop(item)) {
+				auto &url = std::get<0>(item);
+				try {
+					write(url, std::get<1>(item), std::get<2>(item), std::get<3>(item));
+				} catch (std::exception &e) { // a cache failure doesn't fail the fetch
+					WARNING("failed to store the response in the cache: " << e.what() << " (for URL=" << url << ")")
+				}
+				item = {}; // free the body
+			}
+		});
+	}
+	~ResponseCache() { // stores the queued responses
+		queue.close();
+		thread.join();
+	}
+
+	void store(const std::string &url, const std::string &content, const std::string &lastModified, const std::string &etag) { // blocks while the queue is full
+		queue.push({url, content, lastModified, etag});
+	}
+
+	FetchResult replay(const FetchRequest &request) const { // the cached response as the server would have sent it
+		FetchResult result;
+
+		// entry
+		std::ifstream file(entryPathFor(request.url));
+		if (!file) {
+			result.error = "the URL isn't in the cache";
+			return result;
+		}
+		json entry;
+		try {
+			entry = json::parse(file);
+		} catch (json::exception &e) {
+			result.error = STR("the cache entry is damaged: " << e.what());
+			return result;
+		}
+		std::string hash = entry["hash"], lastModified = entry["last_modified"], etag = entry["etag"];
+		size_t size = entry["size"];
+
+		// conditional request
+		if ((!request.knownETag.empty() && request.knownETag == etag) || (!request.knownLastModified.empty() && request.knownLastModified == lastModified)) {
+			result.waived = true;
+			result.httpStatus = 304;
+			return result;
+		}
+
+		// body
+		auto bodyPath = dir / "bodies" / (hash + ".gz");
+		gzFile gz = ::gzopen(bodyPath.c_str(), "rb");
+		if (!gz) {
+			result.error = STR("the cached body " << bodyPath << " is missing");
+			return result;
+		}
+		result.content.resize(size);
+		bool ok = size == 0 || ::gzread(gz, result.content.data(), size) == int(size);
+		::gzclose(gz);
+		if (!ok || formatHash(xxh64(result.content)) != hash) {
+			result = {};
+			result.error = STR("the cached body " << bodyPath << " is damaged");
+			return result;
+		}
+		result.httpStatus = 200;
+		if (request.needLastModified) {
+			result.lastModified = lastModified;
+			result.etag = etag;
+		}
+		return result;
+	}
 
-		// get HTTP Last-Modified if requested
-		if (needLastModified) {
-			*needLastModified = getOneHeader(curl, "Last-Modified");
+private:
+	typedef std::tuple<std::string/*url*/, std::string/*content*/, std::string/*lastModified*/, std::string/*etag*/> Item;
+
+	const fs::path       dir;
+	BoundedQueue<Item>   queue; // responses to be stored
+	std::thread          thread;
+
+	void write(const std::string &url, const std::string &content, const std::string &lastModified, const std::string &etag) const {
+		// body, unless the same body is already there
+		auto hash = formatHash(xxh64(content));
+		auto bodyPath = dir / "bodies" / (hash + ".gz");
+		if (!fs::exists(bodyPath)) {
+			auto tmpPath = tmpPathFor(bodyPath);
+			gzFile gz = ::gzopen(tmpPath.c_str(), "wb1"); // fastest
+			if (!gz)
+				FAIL("failed to create the cache file " << tmpPath)
+			bool ok = content.empty() || ::gzwrite(gz, content.data(), content.size()) == int(content.size());
+			if (::gzclose(gz) != Z_OK || !ok)
+				FAIL("failed to write the cache file " << tmpPath)
+			fs::rename(tmpPath, bodyPath);
 		}
 
+		// entry
+		auto entryPath = entryPathFor(url);
+		auto tmpPath = tmpPathFor(entryPath);
+		writeFile(tmpPath, json({
+			{"url", url},
+			{"hash", hash},
+			{"size", content.size()},
+			{"last_modified", lastModified},
+			{"etag", etag},
+			{"fetched", ::time(nullptr)}
+		}).dump());
+		fs::rename(tmpPath, entryPath);
+	}
+
+	fs::path entryPathFor(const std::string &url) const {
+		return dir / "urls" / (formatHash(xxh64(url)) + ".json");
+	}
+	static fs::path tmpPathFor(const fs::path &path) { // unique per thread, renamed into place once complete
+		return STR(path.string() << ".tmp." << ::getpid() << "." << std::this_thread::get_id());
+	}
+};
+
+struct FetchEngine {
+	typedef std::function<void(FetchResult &&result)> Callback;
+
+	FetchEngine(bool offline_ = false)
+	: offline(offline_)
+	, cache(::getenv("BUILDSDB_CACHE_DIR") ? std::make_unique<ResponseCache>(::getenv("BUILDSDB_CACHE_DIR")) : nullptr)
+	, maxInFlight(envUnsigned("BUILDSDB_MAX_IN_FLIGHT", 64))
+	, maxRetries(envUnsigned("BUILDSDB_FETCH_RETRIES", 4))
+	, retryDelayMs(envUnsigned("BUILDSDB_FETCH_RETRY_DELAY_MS", 500))
+	, http2(envUnsigned("BUILDSDB_HTTP2", 1) != 0)
+	, acceptEncoding(::getenv("BUILDSDB_ACCEPT_ENCODING") ? ::getenv("BUILDSDB_ACCEPT_ENCODING") : "") // empty means all encodings that libcurl supports
+	{
+		// check
+		if (offline && !cache)
+			FAIL("the offline fetch needs the response cache, please set BUILDSDB_CACHE_DIR")
+
+		// curl global initialization has to happen before any threads are started
+		static std::once_flag curlInitialized;
+		std::call_once(curlInitialized, []() {
+			curl_global_init(CURL_GLOBAL_DEFAULT);
+		});
+
+		// create the multi handle that owns the connection cache
+		if (!(multi = curl_multi_init()))
+			FAIL("failed to initialize the CURL multi handle")
+		curl_multi_setopt(multi, CURLMOPT_PIPELINING, http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+		curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, long(envUnsigned("BUILDSDB_MAX_HOST_CONNECTIONS", 8)));
+		curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, long(envUnsigned("BUILDSDB_MAX_HOST_CONNECTIONS", 8)*4));
+
+		// start the transfer thread
+		thread = std::thread([this]() {
+			Trace::ThreadName threadName("curl");
+			run();
+		});
+	}
+	~FetchEngine() {
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			stopping = true;
+		}
+		curl_multi_wakeup(multi);
+		thread.join();
+
 		// cleanup
-		curl_easy_cleanup(curl);
+		for (auto curl : idleHandles)
+			curl_easy_cleanup(curl);
+		curl_multi_cleanup(multi);
+	}
 
-		// dump files if requested
-		if (::getenv("BUILDSDB_DUMP_DOWNLOADED_FILES")) {
-			static unsigned fileNo = 1;
-
-			// generate debug file number
-			unsigned fno;
-			if (::getenv("BUILDSDB_SEQUENTIAL"))
-				fno = fileNo++;
-			else {
-				static std::mutex mutex;
+	// submit a request, the callback is called from the transfer thread and should be quick,
+	// in the offline mode it is called right away from the calling thread
+	void fetchAsync(FetchRequest &&request, Callback &&callback) {
+		// offline: the response is replayed from the cache right away
+		if (offline) {
+			FetchResult result;
+			if (cancelled)
+				result.error = "the fetch was cancelled";
+			else
+				result = cache->replay(request);
+			numRequests++;
+			if (result.waived)
+				numWaived++;
+			if (!result.error.empty())
+				numErrors++;
+			bytesDecoded += result.content.size();
+			callback(std::move(result));
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			queue.push_back(std::make_unique<Transfer>(std::move(request), std::move(callback)));
+			numOutstanding++;
+		}
+		curl_multi_wakeup(multi);
+	}
+
+	// submit a request and wait for its result
+	FetchResult fetch(FetchRequest &&request) {
+		auto url = request.url;
+		TraceSpan span("fetch", "curl", [&url]() -> Trace::Args {return {{"url", url}};});
+		std::promise<FetchResult> promise;
+		auto future = promise.get_future();
+		fetchAsync(std::move(request), [&promise](FetchResult &&result) {
+			promise.set_value(std::move(result));
+		});
+		auto result = future.get();
+		if (!result.error.empty())
+			FAIL("failed to fetch from the URL '" << url << "': " << result.error)
+		return result;
+	}
+
+	// fail all submitted requests that haven't completed yet, and all requests submitted later, from any thread
+	void cancel() {
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			cancelled = true;
+		}
+		curl_multi_wakeup(multi);
+	}
+	bool isCancelled() const {
+		return cancelled;
+	}
+
+	// statistics
+	std::atomic<uint64_t>                   numRequests{0};
+	std::atomic<uint64_t>                   numWaived{0};
+	std::atomic<uint64_t>                   bytesOnWire{0};
+	std::atomic<uint64_t>                   bytesDecoded{0};
+	std::atomic<uint64_t>                   numErrors{0};
+	std::atomic<uint64_t>                   numRetries{0};
+
+	// detailed statistics: only written by the transfer thread, only read when the engine is idle
+	struct ServerStats {
+		uint64_t   numRequests = 0;
+		uint64_t   bytesOnWire = 0;
+		double     seconds = 0; // sum of transfer times
+	};
+	Histogram                               latency;
+	std::map<std::string, ServerStats>      serverStats;
+
+	void resetStatistics() { // only while idle
+		numRequests = 0;
+		numWaived = 0;
+		bytesOnWire = 0;
+		bytesDecoded = 0;
+		numErrors = 0;
+		numRetries = 0;
+		latency = {};
+		serverStats.clear();
+	}
+
+	std::string summary() const {
+		return STR(
+			numRequests << " request(s), " << numWaived << " not modified, " << numRetries << " retried, "
+			<< formatBytes(bytesOnWire) << " on the wire, " << formatBytes(bytesDecoded) << " decoded"
+		);
+	}
+
+	bool idle() {
+		std::lock_guard<std::mutex> guard(mutex);
+		return numOutstanding == 0;
+	}
+
+	unsigned getMaxInFlight() const {
+		return maxInFlight;
+	}
+
+	// wait until all submitted requests are completed and their callbacks have returned
+	void waitIdle() {
+		std::unique_lock<std::mutex> lock(mutex);
+		idleCondition.wait(lock, [this]() {
+			return numOutstanding == 0;
+		});
+	}
+
+private:
+	struct Transfer {
+		FetchRequest   request;
+		Callback       callback;
+		FetchResult    result;
+		curl_slist     *headers = nullptr;
+		unsigned       numRetries = 0;
+
+		Transfer(FetchRequest &&request_, Callback &&callback_)
+		: request(std::move(request_))
+		, callback(std::move(callback_))
+		{ }
+		~Transfer() {
+			curl_slist_free_all(headers);
+		}
+	};
+
+	const bool                              offline;
+	const std::unique_ptr<ResponseCache>    cache; // BUILDSDB_CACHE_DIR
+	const unsigned                          maxInFlight;
+	const unsigned                          maxRetries;
+	const unsigned                          retryDelayMs; // doubles with every retry
+	const bool                              http2;
+	const std::string                       acceptEncoding;
+	CURLM                                   *multi = nullptr;
+	std::thread                             thread;
+	std::mutex                              mutex;
+	std::condition_variable                 idleCondition;
+	std::deque<std::unique_ptr<Transfer>>   queue;           // protected by mutex
+	unsigned                                numOutstanding = 0; // protected by mutex: queued, in transit or in the callback
+	bool                                    stopping = false; // protected by mutex
+	std::atomic<bool>                       cancelled{false}; // written under mutex
+	unsigned                                numInFlight = 0; // only used by the transfer thread
+	std::set<CURL*>                         inFlightHandles; // only used by the transfer thread
+	std::vector<CURL*>                      idleHandles;     // only used by the transfer thread
+	std::multimap<std::chrono::steady_clock::time_point, std::unique_ptr<Transfer>> delayed; // only used by the transfer thread: retries waiting for their time
+	std::minstd_rand                        random;          // only used by the transfer thread
+
+	void run() {
+		while (true) {
+			// start queued transfers up to the in-flight limit, retries go first when their time has come
+			auto now = std::chrono::steady_clock::now();
+			std::vector<std::unique_ptr<Transfer>> toStart, toCancel;
+			{
 				std::lock_guard<std::mutex> guard(mutex);
-				fno = fileNo++;
+				if (cancelled) { // nothing is started anymore
+					for (auto &d : delayed)
+						toCancel.push_back(std::move(d.second));
+					delayed.clear();
+					for (auto &q : queue)
+						toCancel.push_back(std::move(q));
+					queue.clear();
+				}
+				while (!delayed.empty() && delayed.begin()->first <= now) {
+					queue.push_front(std::move(delayed.begin()->second));
+					delayed.erase(delayed.begin());
+				}
+				if (stopping && queue.empty() && delayed.empty() && numInFlight == 0)
+					return;
+				while (!queue.empty() && numInFlight + toStart.size() < maxInFlight) {
+					toStart.push_back(std::move(queue.front()));
+					queue.pop_front();
+				}
+			}
+			for (auto &transfer : toStart)
+				start(std::move(transfer));
+			if (cancelled) {
+				for (auto &transfer : toCancel) {
+					transfer->result = {};
+					transfer->result.error = "the fetch was cancelled";
+					finish(std::move(transfer));
+				}
+				while (!inFlightHandles.empty())
+					cancelInFlight(*inFlightHandles.begin());
 			}
 
-			// write debug files
-			writeFile(STR("debug." << fno << ".url.txt"), url);
-			writeFile(STR("debug." << fno << ".content.json"), str);
+			// drive transfers
+			int running = 0;
+			curl_multi_perform(multi, &running);
+
+			// process completed transfers
+			int msgsLeft = 0;
+			while (CURLMsg *msg = curl_multi_info_read(multi, &msgsLeft))
+				if (msg->msg == CURLMSG_DONE)
+					complete(msg->easy_handle, msg->data.result);
+
+			// wait for network activity, for a wakeup, or for the next retry
+			int timeoutMs = 1000;
+			if (!delayed.empty())
+				timeoutMs = std::clamp(int(std::chrono::duration_cast<std::chrono::milliseconds>(delayed.begin()->first - std::chrono::steady_clock::now()).count()), 0, timeoutMs);
+			curl_multi_poll(multi, nullptr, 0, timeoutMs, nullptr);
 		}
+	}
 
-		return {false/*not waived*/, str};
-	} else {
-		throw std::runtime_error(STR("failed to initialize CURL for the URL '" << url << "'"));
+	void start(std::unique_ptr<Transfer> &&transfer) {
+		// reuse an easy handle when possible, connections themselves are cached by the multi handle
+		CURL *curl;
+		if (!idleHandles.empty()) {
+			curl = idleHandles.back();
+			idleHandles.pop_back();
+			curl_easy_reset(curl);
+		} else if (!(curl = curl_easy_init())) {
+			transfer->result.error = "failed to initialize CURL";
+			finish(std::move(transfer));
+			return;
+		}
+
+		// set general options
+		if (::getenv("HTTP_PROXY"))
+			curl_easy_setopt(curl, CURLOPT_PROXY, ::getenv("HTTP_PROXY")); // ex. "socks5://localhost:9050"
+		curl_easy_setopt(curl, CURLOPT_URL, transfer->request.url.c_str());
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, http2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, http2 ? 1L : 0L); // prefer to multiplex over an existing connection
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L); // stalled transfers fail, and are retried
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+		curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, acceptEncoding.c_str()); // compressed transfer, decoded by curl while the body arrives
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writeData); // fn
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &transfer->result.content); // for fn
+
+		// conditional request: the server replies with 304 Not Modified when the DB already has this version
+		curl_slist_free_all(transfer->headers); // from the previous attempt
+		transfer->headers = nullptr;
+		if (!transfer->request.knownLastModified.empty())
+			transfer->headers = curl_slist_append(transfer->headers, CSTR("If-Modified-Since: " << transfer->request.knownLastModified));
+		if (!transfer->request.knownETag.empty())
+			transfer->headers = curl_slist_append(transfer->headers, CSTR("If-None-Match: " << transfer->request.knownETag));
+		if (transfer->headers)
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer->headers);
+
+		transfer->result.content.reserve(1024*10);
+
+		// add
+		if (auto trace = Trace::get())
+			trace->asyncBegin("transfer", "curl", uint64_t(transfer.get()), {{"url", transfer->request.url}});
+		curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer.get());
+		curl_multi_add_handle(multi, curl);
+		(void)transfer.release(); // now owned by the easy handle
+		inFlightHandles.insert(curl);
+		numInFlight++;
+	}
+
+	void cancelInFlight(CURL *curl) {
+		Transfer *transferRaw = nullptr;
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, &transferRaw);
+		std::unique_ptr<Transfer> transfer(transferRaw);
+		curl_multi_remove_handle(multi, curl);
+		inFlightHandles.erase(curl);
+		if (auto trace = Trace::get())
+			trace->asyncEnd("transfer", "curl", uint64_t(transfer.get()), {{"status", "cancelled"}});
+		transfer->result = {};
+		transfer->result.error = "the fetch was cancelled";
+		idleHandles.push_back(curl);
+		numInFlight--;
+		finish(std::move(transfer));
+	}
+
+	void complete(CURL *curl, CURLcode res) {
+		// take back the ownership of the transfer
+		Transfer *transferRaw = nullptr;
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, &transferRaw);
+		std::unique_ptr<Transfer> transfer(transferRaw);
+		auto &url = transfer->request.url;
+		auto &result = transfer->result;
+
+		curl_multi_remove_handle(multi, curl);
+		inFlightHandles.erase(curl);
+
+		// check
+		if (res != CURLE_OK)
+			result.error = curl_easy_strerror(res);
+		else
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &result.httpStatus);
+		if (auto trace = Trace::get())
+			trace->asyncEnd("transfer", "curl", uint64_t(transfer.get()), {{"status", result.error.empty() ? STR(result.httpStatus) : result.error}});
+
+		// statistics
+		curl_off_t sizeDownload = 0, totalTime = 0;
+		curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &sizeDownload);
+		curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &totalTime); // in microseconds
+		result.bytesOnWire = sizeDownload;
+		numRequests++;
+		bytesOnWire += result.bytesOnWire;
+		bytesDecoded += result.content.size();
+		latency.observe(totalTime/1e6);
+		auto &ss = serverStats[serverOf(url)];
+		ss.numRequests++;
+		ss.bytesOnWire += result.bytesOnWire;
+		ss.seconds += totalTime/1e6;
+
+		// transient failures are retried with exponential backoff and jitter
+		bool transient = res != CURLE_OK || result.httpStatus == 429 || result.httpStatus >= 500;
+		if (transient && transfer->numRetries < maxRetries && !cancelled) {
+			auto delayMs = (retryDelayMs << transfer->numRetries++);
+			delayMs += random() % (delayMs/2 + 1);
+			WARNING(
+				"retrying in " << delayMs << " ms (retry #" << transfer->numRetries << "): "
+				<< (res != CURLE_OK ? result.error : STR("HTTP status " << result.httpStatus)) << " (for URL=" << url << ")"
+			)
+			result = {};
+			idleHandles.push_back(curl);
+			numInFlight--;
+			numRetries++;
+			delayed.emplace(std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs), std::move(transfer));
+			return;
+		}
+		if (transient && result.error.empty())
+			result.error = STR("HTTP status " << result.httpStatus);
+		if (!result.error.empty())
+			numErrors++;
+
+		// not modified?
+		if (result.error.empty() && result.httpStatus == 304) {
+			result.waived = true;
+			result.content.clear();
+			numWaived++;
+		}
+
+		// keep the response in the cache, it is stored by the cache thread
+		if (cache && result.error.empty() && !result.waived && result.httpStatus == 200)
+			cache->store(url, result.content, getOneHeader(curl, url, "Last-Modified", false/*warn*/), getOneHeader(curl, url, "ETag", false/*warn*/));
+
+		// get HTTP Last-Modified and ETag if requested
+		if (result.error.empty() && !result.waived && transfer->request.needLastModified) {
+			result.lastModified = getOneHeader(curl, url, "Last-Modified");
+			result.etag = getOneHeader(curl, url, "ETag", false/*warn*/);
+
+			// some servers ignore conditional requests, still waive the same version
+			if (!result.lastModified.empty() && result.lastModified == transfer->request.knownLastModified) {
+				result.waived = true;
+				result.content.clear();
+				numWaived++;
+			}
+		}
+
+		// dump files if requested
+		if (result.error.empty() && !result.waived && ::getenv("BUILDSDB_DUMP_DOWNLOADED_FILES"))
+			dumpDownloadedFile(url, result.content);
+
+		// release the handle for reuse
+		idleHandles.push_back(curl);
+		numInFlight--;
+
+		finish(std::move(transfer));
 	}
-}
 
-static json F(json j, const char *name) { // get JSON field
+	void finish(std::unique_ptr<Transfer> &&transfer) {
+		transfer->callback(std::move(transfer->result));
+
+		std::lock_guard<std::mutex> guard(mutex);
+		if (--numOutstanding == 0)
+			idleCondition.notify_all();
+	}
+
+	static std::string serverOf(const std::string &url) { // build server URLs are followed by /data/...
+		auto pos = url.find("/data/");
+		if (pos == std::string::npos) // the server list request: only keep the host
+			pos = url.find('/', url.find("://") + 3);
+		return url.substr(0, pos);
+	}
+
+	static std::string getOneHeader(CURL *curl, const std::string &url, const char *headerName, bool warn = true) {
+		struct curl_header *h = nullptr;
+		if (curl_easy_header(curl, headerName, 0, CURLH_HEADER, -1, &h) == CURLHE_OK)
+			return h->value;
+		if (warn)
+			WARNING("no " << headerName << " field is present in the server response (for URL=" << url << ")")
+		return "";
+	}
+};
+
+static const json& F(const json &j, const char *name) { // get JSON field
 	// checks
 	if (!j.is_object())
 		FAIL("JSON is not an object while looking for the field '" << name << "'")
-	if (!j.contains(name))
+	auto i = j.find(name);
+	if (i == j.end())
 		FAIL("JSON object doesn't contain the field '" << name << "'")
 
 	// return field
-	return j[name];
+	return *i;
 }
 
-static bool HAS(json j, const char *name) {
+static bool HAS(const json &j, const char *name) {
 	// checks
 	if (!j.is_object())
 		FAIL("JSON is not an object while looking for the field '" << name << "'")
@@ -287,10 +1082,6 @@ static unsigned S2U(const std::string &str) {
 	return (unsigned)std::stoul(str);
 }
 
-static json fixupReplaceEmptyWithZero(const json &j) {
-	return j.empty() ? j : json("0");
-}
-
 static bool fileExists(const std::string &fileName) {
 	return std::ifstream(fileName).good();
 }
@@ -308,6 +1099,14 @@ static std::string dbPath() {
 	return ::getenv("BUILDSDB_DATABASE") ? ::getenv("BUILDSDB_DATABASE") : "builds.sqlite";
 }
 
+static std::string statusURL() {
+	return ::getenv("BUILDSDB_STATUS_URL") ? ::getenv("BUILDSDB_STATUS_URL") : "https://pkg-status.freebsd.org";
+}
+
+static std::string buildURL(const std::string &server, const std::string &mastername, const std::string &buildname) {
+	return STR(server << "/data/" << mastername << "/" << buildname << "/.data.json");
+}
+
 static std::string dbPathPortsDB() {
 	return ::getenv("PORTSDB_DATABASE") ? ::getenv("PORTSDB_DATABASE") : "ports.sqlite";
 }
@@ -360,7 +1159,10 @@ struct BuildInfo {
 
 	// varous fields
 	bool            waived; // no need to fetch since the DB already has the same version
+	bool            unchanged = false; // waived because the body has the same content hash as in the DB, only Last-Modified and ETag have changed
 	std::string     last_modified;
+	std::string     etag;
+	std::string     content_hash;
 
 	// build summary info
 	std::string     buildname;
@@ -388,28 +1190,38 @@ struct BuildInfo {
 		sz += skipped .size();
 		return sz;
 	}
+	size_t numDone() const {
+		size_t sz = 0;
+		sz += built   .size();
+		sz += failed  .size();
+		sz += ignored .size();
+		sz += skipped .size();
+		return sz;
+	}
 	float progressPercentage() const {
-		size_t numDone = 0;
-		numDone += built   .size();
-		numDone += failed  .size();
-		numDone += ignored .size();
-		numDone += skipped .size();
-
 		// checks
 		if (queued.empty()) {
 			WARNING("no queued records found in the build info set")
 			return 0;
 		}
-		if (queued.size() < numDone) {
-			WARNING("build data set has more done records (" << numDone << ") than queued records (" << queued.size() << ")")
+		if (queued.size() < numDone()) {
+			WARNING("build data set has more done records (" << numDone() << ") than queued records (" << queued.size() << ")")
 			return 0;
 		}
 
-		return float(numDone)/float(queued.size())*100.f;
+		return progressPercentageQuiet();
+	}
+	float progressPercentageQuiet() const { // without the warnings, 0 when the records are inconsistent
+		if (queued.empty() || queued.size() < numDone())
+			return 0;
+		return float(numDone())/float(queued.size())*100.f;
 	}
 	size_t numQueued() const {
 		return queued.size();
 	}
+	bool isFinal() const { // the build has ended and its data will never change again
+		return ended != 0 && status.rfind("stopped:", 0) == 0;
+	}
 };
 
 struct Queries {
@@ -448,6 +1260,17 @@ struct Queries {
 			}
 		}
 
+		std::string sql() const { // {arg} placeholders are replaced with the ?N parameters
+			std::ifstream file(path);
+			std::string sql((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+			for (unsigned a = 0; a < args.size(); a++) {
+				auto placeholder = STR("{" << args[a] << "}");
+				for (size_t pos; (pos = sql.find(placeholder)) != std::string::npos;)
+					sql.replace(pos, placeholder.size(), STR("?" << a + 1));
+			}
+			return sql;
+		}
+
 		friend std::ostream& operator<<(std::ostream &os, const Query &query) {
 			os << query.name;
 			for (auto &arg : query.args)
@@ -525,7 +1348,9 @@ struct Queries {
 
 typedef std::shared_ptr<BuildInfo> BuildInfoPtr;
 
-typedef std::map<std::string/*server*/, std::map<std::string/*masterbuild*/, std::vector<BuildInfoPtr>>> BuildInfos;
+// receives fetched builds as soon as they are complete, possibly from several threads at once
+// bi is nullptr when only the masterbuild itself is reported
+typedef std::function<void(const std::string &server, const std::string &mastername, BuildInfoPtr bi)> BuildSink;
 
 struct Parser {
 	static std::vector<std::string> parseServerMasterBuilds(const json &j) { // assumes json to be an object
@@ -571,497 +1396,2371 @@ struct Parser {
 
 		return bis;
 	}
-	static void parseBuildDetails(const json &j, BuildInfo &bi, const std::string &mastername) {
-		typedef BuildInfo BI;
+	static std::set<std::string> parseRecentServers(const std::string &str, Time since) {
+		// equivalent of jq '.. | select(.started? > since) | .server' streamed over the whole builds document
+		RecentServersSax sax(since);
+		json::sax_parse(str, &sax);
+		return sax.servers;
+	}
+	static void parseBuildDetails(const std::string &str, BuildInfo &bi, const std::string &mastername) {
+		// build details are large: they are parsed with the SAX parser straight into BuildInfo records without building a DOM
+		BuildDetailsSax sax(bi);
+		json::sax_parse(str, &sax);
 
 		// checks
-		if (!j.is_object())
-			FAIL("JSON isn't an object")
-		if (F(j, "mastername") != mastername)
+		if (!sax.hasMastername)
+			FAIL("JSON object doesn't contain the field 'mastername'")
+		if (!sax.hasBuildname)
+			FAIL("JSON object doesn't contain the field 'buildname'")
+		if (!sax.hasJailname)
+			FAIL("JSON object doesn't contain the field 'jailname'")
+		if (sax.mastername != mastername)
 			FAIL("invalid record: mastername mismatches")
-		if (F(j, "buildname") != bi.buildname)
-			FAIL("invalid record: buildname mismatches")
-		if (F(j, "jailname") != bi.jailname)
-			FAIL("invalid record: jailname mismatches")
-
-		// individual parsers
-
-		if (!j.contains("ports"))
-			return;
-		auto jPorts = F(j, "ports");
-		for (auto i = jPorts.begin(); i != jPorts.end(); i++)
-			if (i.key() == "tobuild")
-#if 0
-				parseArray<BI::ToBuild>(i.value(), bi.tobuild, [](const json &j) {
-					if (!j.is_object())
-						FAIL("JSON isn't an object")
-					return BI::ToBuild{
-						BI::Base{
-							F(j, "origin"),
-							F(j, "pkgname")
-						}
-					};
-				});
-#endif
-				{ }
-			else if (i.key() == "queued")
-				parseArray<BI::Queued>(i.value(), bi.queued, [](const json &j) {
-					if (!j.is_object())
-						FAIL("JSON isn't an object")
-					return BI::Queued{
-						BI::Base{
-							F(j, "origin"),
-							F(j, "pkgname")
-						},
-						F(j, "reason")
-					};
-				});
-			else if (i.key() == "built")
-				parseArray<BI::Built>(i.value(), bi.built, [](const json &j) {
-					if (!j.is_object())
-						FAIL("JSON isn't an object")
-					return BI::Built{
-						BI::Base{
-							F(j, "origin"),
-							F(j, "pkgname")
-						},
-						S2U(F(j, "elapsed"))
-					};
-				});
-			else if (i.key() == "failed")
-				parseArray<BI::Failed>(i.value(), bi.failed, [](const json &j) {
-					if (!j.is_object())
-						FAIL("JSON isn't an object")
-					return BI::Failed{
-						BI::Base{
-							F(j, "origin"),
-							F(j, "pkgname")
-						},
-						F(j, "phase"),
-						F(j, "errortype"),
-						S2U(fixupReplaceEmptyWithZero(F(j, "elapsed"))) // 'elapsed' can be empty when it fails in the 'starting' phase
-					};
-				});
-			else if (i.key() == "ignored")
-				parseArray<BI::Ignored>(i.value(), bi.ignored, [](const json &j) {
-					if (!j.is_object())
-						FAIL("JSON isn't an object")
-					return BI::Ignored{
-						BI::Base{
-							F(j, "origin"),
-							F(j, "pkgname")
-						},
-						F(j, "reason")
-					};
-				});
-			else if (i.key() == "skipped")
-				parseArray<BI::Skipped>(i.value(), bi.skipped, [](const json &j) {
-					if (!j.is_object())
-						FAIL("JSON isn't an object")
-					return BI::Skipped{
-						BI::Base{
-							F(j, "origin"),
-							F(j, "pkgname")
-						},
-						F(j, "depends")
-					};
-				});
-			else
-				FAIL("unknown key '" << i.key() << "' found in the details record")
 	}
-	template<typename T>
-	static void parseArray(const json &j, std::vector<T> &arr, std::function<T(const json &j)> one) {
-		// check
-		if (!j.is_array())
-			FAIL("JSON isn't an array")
 
-		// reserve arr entries
-		arr.reserve(j.size()); // assume that it's size=0
+private:
+	struct RecentServersSax : nlohmann::json_sax<json> {
+		struct Frame {
+			bool         isObject;
+			std::string  key;
+			Time         started = 0;
+			std::string  server;
+		};
 
-		for (unsigned i = 0; i < j.size(); i++)
-			arr.push_back(one(j[i]));
-	}
-};
+		const Time              since;
+		std::vector<Frame>      stack;
+		std::set<std::string>   servers;
 
-struct Database : SQLite::Database {
-	Database(bool create)
-	: SQLite::Database(
-		dbPath().c_str(),
-		SQLite::OPEN_READWRITE|(create ? SQLite::OPEN_CREATE : 0)
-	) { }
+		RecentServersSax(Time since_)
+		: since(since_)
+		{ }
 
-	static bool canOpenExistingDB() {
-		try {
-			Database(false);
+		bool null() override {
 			return true;
-		} catch(...) {
-			return false;
 		}
-	}
-};
-
-//
+		bool boolean(bool val) override {
+			return true;
+		}
+		bool number_integer(number_integer_t val) override {
+			return started(val > 0 ? Time(val) : 0);
+		}
+		bool number_unsigned(number_unsigned_t val) override {
+			return started(Time(val));
+		}
+		bool number_float(number_float_t val, const string_t &s) override {
+			return started(val > 0 ? Time(val) : 0);
+		}
+		bool string(string_t &val) override {
+			if (!stack.empty() && stack.back().isObject) {
+				if (stack.back().key == "server")
+					stack.back().server = std::move(val);
+				else if (stack.back().key == "started")
+					started(Time(std::strtoul(val.c_str(), nullptr, 10)));
+			}
+			return true;
+		}
+		bool binary(binary_t &val) override {
+			return true;
+		}
+		bool start_object(std::size_t elements) override {
+			stack.push_back({true});
+			return true;
+		}
+		bool end_object() override {
+			auto &frame = stack.back();
+			if (frame.started > since && !frame.server.empty())
+				servers.insert(frame.server);
+			stack.pop_back();
+			return true;
+		}
+		bool start_array(std::size_t elements) override {
+			stack.push_back({false});
+			return true;
+		}
+		bool end_array() override {
+			stack.pop_back();
+			return true;
+		}
+		bool key(string_t &val) override {
+			stack.back().key = std::move(val);
+			return true;
+		}
+		bool parse_error(std::size_t position, const std::string &last_token, const nlohmann::detail::exception &ex) override {
+			FAIL("JSON parsing failed: " << ex.what())
+		}
+
+	private:
+		bool started(Time val) {
+			if (!stack.empty() && stack.back().isObject && stack.back().key == "started")
+				stack.back().started = val;
+			return true;
+		}
+	};
+	struct BuildDetailsSax : nlohmann::json_sax<json> {
+		// layout: {"mastername":..., "buildname":..., "jailname":..., "ports":{"queued":[{"origin":..., ...}, ...], ...}, ...}
+		enum Section {None, Queued, Built, Failed, Ignored, Skipped};
+		enum Level {Top = 1, Ports = 2, Array = 3, Record = 4};
+
+		BuildInfo    &bi;
+		unsigned     depth = 0;
+		unsigned     skipDepth = 0; // non-zero while inside a subtree that is ignored
+		bool         inPorts = false;
+		Section      section = None;
+		std::string  lastKey;
+
+		// top-level fields
+		std::string  mastername;
+		bool         hasMastername = false;
+		bool         hasBuildname = false;
+		bool         hasJailname = false;
+
+		// fields of the current record
+		struct Fields {
+			std::string origin, pkgname, reason, elapsed, phase, errortype, depends;
+			unsigned    present = 0; // bit set of fields
+		} fields;
+		enum FieldBit {Origin = 1, Pkgname = 2, Reason = 4, Elapsed = 8, Phase = 16, Errortype = 32, Depends = 64};
+
+		BuildDetailsSax(BuildInfo &bi_)
+		: bi(bi_)
+		{ }
+
+		// values
+		bool null() override {
+			return value(nullptr);
+		}
+		bool boolean(bool val) override {
+			return value(nullptr);
+		}
+		bool number_integer(number_integer_t val) override {
+			auto str = std::to_string(val);
+			return value(&str);
+		}
+		bool number_unsigned(number_unsigned_t val) override {
+			auto str = std::to_string(val);
+			return value(&str);
+		}
+		bool number_float(number_float_t val, const string_t &s) override {
+			return value(nullptr);
+		}
+		bool string(string_t &val) override {
+			return value(&val);
+		}
+		bool binary(binary_t &val) override {
+			return value(nullptr);
+		}
+
+		// containers
+		bool start_object(std::size_t elements) override {
+			if (skipDepth)
+				return ++depth, true;
+			depth++;
+			if (depth == Top)
+				{ }
+			else if (depth == Ports && lastKey == "ports")
+				inPorts = true;
+			else if (depth == Array && inPorts && lastKey != "tobuild")
+				FAIL("JSON isn't an array")
+			else if (depth == Record && section != None)
+				fields.present = 0;
+			else
+				skipDepth = depth;
+			return true;
+		}
+		bool end_object() override {
+			if (skipDepth) {
+				if (depth-- == skipDepth)
+					skipDepth = 0;
+				return true;
+			}
+			if (depth == Record && section != None)
+				record();
+			else if (depth == Ports)
+				inPorts = false;
+			depth--;
+			return true;
+		}
+		bool start_array(std::size_t elements) override {
+			if (skipDepth)
+				return ++depth, true;
+			depth++;
+			if (depth == Top)
+				FAIL("JSON isn't an object")
+			else if (depth == Array && inPorts && lastKey != "tobuild") // 'tobuild' isn't stored, its contents are skipped
+				section = sectionByName(lastKey);
+			else if (depth == Record && section != None)
+				FAIL("JSON isn't an object")
+			else
+				skipDepth = depth;
+			return true;
+		}
+		bool end_array() override {
+			if (skipDepth) {
+				if (depth-- == skipDepth)
+					skipDepth = 0;
+				return true;
+			}
+			if (depth == Array)
+				section = None;
+			depth--;
+			return true;
+		}
+		bool key(string_t &val) override {
+			if (!skipDepth)
+				lastKey = std::move(val);
+			return true;
+		}
+		bool parse_error(std::size_t position, const std::string &last_token, const nlohmann::detail::exception &ex) override {
+			FAIL("JSON parsing failed: " << ex.what())
+		}
+
+	private:
+		bool value(std::string *val) {
+			if (skipDepth)
+				return true;
+			if (depth == 0)
+				FAIL("JSON isn't an object")
+			else if (depth == Top) {
+				if (lastKey == "mastername") {
+					if (!val)
+						FAIL("invalid record: mastername mismatches")
+					mastername = *val;
+					hasMastername = true;
+				} else if (lastKey == "buildname") {
+					if (!val || *val != bi.buildname)
+						FAIL("invalid record: buildname mismatches")
+					hasBuildname = true;
+				} else if (lastKey == "jailname") {
+					if (!val || *val != bi.jailname)
+						FAIL("invalid record: jailname mismatches")
+					hasJailname = true;
+				}
+			} else if (depth == Ports && inPorts && lastKey != "tobuild")
+				FAIL("JSON isn't an array")
+			else if (depth == Array && section != None)
+				FAIL("JSON isn't an object")
+			else if (depth == Record && section != None && val) {
+				if (lastKey == "origin")
+					setField(fields.origin, Origin, *val);
+				else if (lastKey == "pkgname")
+					setField(fields.pkgname, Pkgname, *val);
+				else if (lastKey == "reason")
+					setField(fields.reason, Reason, *val);
+				else if (lastKey == "elapsed")
+					setField(fields.elapsed, Elapsed, *val);
+				else if (lastKey == "phase")
+					setField(fields.phase, Phase, *val);
+				else if (lastKey == "errortype")
+					setField(fields.errortype, Errortype, *val);
+				else if (lastKey == "depends")
+					setField(fields.depends, Depends, *val);
+			}
+			return true;
+		}
+		void setField(std::string &field, FieldBit bit, std::string &val) {
+			field = std::move(val);
+			fields.present |= bit;
+		}
+		std::string &getField(std::string &field, FieldBit bit, const char *name) {
+			if (!(fields.present & bit))
+				FAIL("JSON object doesn't contain the field '" << name << "'")
+			return field;
+		}
+		void record() {
+			typedef BuildInfo BI;
+
+			auto base = [this]() {
+				return BI::Base{
+					std::move(getField(fields.origin, Origin, "origin")),
+					std::move(getField(fields.pkgname, Pkgname, "pkgname"))
+				};
+			};
+
+			switch (section) {
+			case None:
+				break;
+			case Queued:
+				bi.queued.push_back(BI::Queued{
+					base(),
+					std::move(getField(fields.reason, Reason, "reason"))
+				});
+				break;
+			case Built:
+				bi.built.push_back(BI::Built{
+					base(),
+					S2U(getField(fields.elapsed, Elapsed, "elapsed"))
+				});
+				break;
+			case Failed: {
+				auto &elapsed = getField(fields.elapsed, Elapsed, "elapsed");
+				bi.failed.push_back(BI::Failed{
+					base(),
+					std::move(getField(fields.phase, Phase, "phase")),
+					std::move(getField(fields.errortype, Errortype, "errortype")),
+					elapsed.empty() ? 0 : S2U(elapsed) // 'elapsed' can be empty when it fails in the 'starting' phase
+				});
+				break;
+			} case Ignored:
+				bi.ignored.push_back(BI::Ignored{
+					base(),
+					std::move(getField(fields.reason, Reason, "reason"))
+				});
+				break;
+			case Skipped:
+				bi.skipped.push_back(BI::Skipped{
+					base(),
+					std::move(getField(fields.depends, Depends, "depends"))
+				});
+				break;
+			}
+		}
+		static Section sectionByName(const std::string &name) {
+			if (name == "queued")
+				return Queued;
+			else if (name == "built")
+				return Built;
+			else if (name == "failed")
+				return Failed;
+			else if (name == "ignored")
+				return Ignored;
+			else if (name == "skipped")
+				return Skipped;
+			else
+				FAIL("unknown key '" << name << "' found in the details record")
+		}
+	};
+};
+
+struct Database : SQLite::Database {
+	Database(bool create)
+	: SQLite::Database(
+		dbPath().c_str(),
+		SQLite::OPEN_READWRITE|(create ? SQLite::OPEN_CREATE : 0)
+	) { }
+
+	SQLite::Statement& cachedStatement(const std::string &sql) { // statements are prepared once per connection
+		auto &stmt = statementCache[sql];
+		if (!stmt) {
+			stmt = std::make_unique<SQLite::Statement>(*this, sql);
+		} else {
+			stmt->reset();
+			stmt->clearBindings();
+		}
+		return *stmt;
+	}
+
+	void resetStatements() { // statements that weren't stepped to completion keep the read transaction open
+		for (sqlite3_stmt *stmt = nullptr; (stmt = sqlite3_next_stmt(getHandle(), stmt)) != nullptr;) // also the static SQL_STMT ones
+			sqlite3_reset(stmt);
+	}
+
+	static bool canOpenExistingDB() {
+		try {
+			Database(false);
+			return true;
+		} catch(...) {
+			return false;
+		}
+	}
+
+	static unsigned latestSchemaVersion() {
+		unsigned version = 0;
+		while (dbSchemaUpgrades[version])
+			version++;
+		return version;
+	}
+
+	unsigned schemaVersion() { // a new DB is at the latest version, DBs created before the version was recorded are at version 0
+		if (!tableExists("build"))
+			return latestSchemaVersion();
+		unsigned version = 0;
+		if (tableExists("schema_version")) {
+			SQLite::Statement stmt(*this, "SELECT max(version) FROM schema_version");
+			if (stmt.executeStep() && !stmt.getColumn(0).isNull())
+				version = stmt.getColumn(0);
+		}
+		return version;
+	}
+
+	void checkSchemaVersion() { // only fetch upgrades the schema, other commands require it to be current
+		auto version = schemaVersion(), latestVersion = latestSchemaVersion();
+		if (version > latestVersion)
+			FAIL("the database schema version " << version << " is newer than what this version of buildsdb supports (" << latestVersion << ")")
+		if (version < latestVersion)
+			FAIL("the database schema version " << version << " is older than what this version of buildsdb uses (" << latestVersion << "), please run 'buildsdb fetch' to upgrade the database")
+	}
+
+	void createSchema(bool deferIndexes = false) {
+		// versions
+		auto latestVersion = latestSchemaVersion();
+		auto version = schemaVersion();
+
+		// check
+		if (version > latestVersion)
+			FAIL("the database schema version " << version << " is newer than what this version of buildsdb supports (" << latestVersion << ")")
+
+		SQLite::Transaction transaction(*this);
+
+		// upgrade
+		bool upgraded = version < latestVersion;
+		for (; version < latestVersion; version++) {
+			MSG("upgrading the database schema from version " << version << " to version " << version + 1)
+			exec(dbSchemaUpgrades[version]);
+		}
+
+		// create missing tables, indexes and views
+		exec(dbSchema);
+		if (!deferIndexes)
+			exec(dbSchemaIndexes);
+
+		// record the version
+		exec("DELETE FROM schema_version");
+		exec(STR("INSERT INTO schema_version(version) VALUES(" << version << ")"));
+
+		transaction.commit();
+
+		// upgrades that have moved data leave much free space behind
+		if (upgraded && execAndGet("PRAGMA freelist_count").getInt64() > execAndGet("PRAGMA page_count").getInt64()/4) {
+			MSG("compacting the database")
+			exec("VACUUM");
+		}
+	}
+
+private:
+	std::map<std::string, std::unique_ptr<SQLite::Statement>> statementCache;
+};
+
+struct BuildWriter { // writes fetched builds into the DB, one transaction per build
+	Database &db;
+	const bool bulkLoad; // loading into an empty DB: builds are committed in batches, indexes and checks are deferred to finish()
+	int64_t runId = 0; // the fetch_run that saved builds are journaled under in fetch_progress, 0 for none
+	std::string savedJournalMode; // before the bulk load, restored in finish(), kept in fetch_run for the fetch that resumes the run
+	unsigned numSaved = 0;
+	uint64_t numRowsWritten = 0;
+	double secondsWriting = 0;
+	Histogram commitLatency;
+
+	BuildWriter(Database &db_, bool bulkLoad_ = false)
+	: db(db_)
+	, bulkLoad(bulkLoad_)
+	, ports(db, "port", "origin")
+	, packages(db, "package", "pkgname")
+	, bulkLoadBatchSize(envUnsigned("BUILDSDB_BULK_LOAD_BATCH", 32))
+	{
+		if (!bulkLoad) {
+			// enable foreign keys
+			db.exec("PRAGMA foreign_keys = ON"); // this doesn't cause performance problem practically, otheriwse PRAGMA foreign_key_check; should be run in the end
+		} else {
+			db.exec("PRAGMA foreign_keys = OFF"); // checked once in finish()
+			savedJournalMode = db.execAndGet("PRAGMA journal_mode").getString();
+			db.exec("PRAGMA journal_mode = WAL");
+			db.exec("PRAGMA synchronous = OFF");
+			db.exec(STR("PRAGMA cache_size = -" << envUnsigned("BUILDSDB_BULK_LOAD_CACHE_MB", 512)*1024)); // in KiB
+			db.exec("PRAGMA temp_store = MEMORY");
+		}
+	}
+
+	void resetStatistics() {
+		numSaved = 0;
+		numRowsWritten = 0;
+		secondsWriting = 0;
+		commitLatency = {};
+	}
+
+	void write(const std::string &server, const std::string &mastername, const BuildInfoPtr &bi) {
+		auto masterbuild_id = getMasterbuildId(getServerId(server), mastername);
+
+		// nothing else to do for masterbuilds
+		if (!bi)
+			return;
+
+		// waived builds: the DB has the current data, unchanged ones only get the new version, seal it when the build has ended
+		if (bi->waived) {
+			if (bi->unchanged || bi->isFinal()) {
+				begin();
+				bool saved = false;
+				if (bi->unchanged) {
+					SQL_STMT(stmtUpdateVersion, "UPDATE build SET last_modified=?, etag=? WHERE masterbuild_id=? AND name=?")
+					stmtUpdateVersion.bind(1, bi->last_modified);
+					if (!bi->etag.empty())
+						stmtUpdateVersion.bind(2, bi->etag);
+					stmtUpdateVersion.bind(3, masterbuild_id);
+					stmtUpdateVersion.bind(4, bi->buildname);
+					saved = stmtUpdateVersion.exec() > 0;
+				}
+				if (bi->isFinal()) {
+					SQL_STMT(stmtSealBuild, "UPDATE build SET ended=?, status=?, sealed=1 WHERE masterbuild_id=? AND name=? AND sealed=0")
+					stmtSealBuild.bind(1, bi->ended);
+					stmtSealBuild.bind(2, bi->status);
+					stmtSealBuild.bind(3, masterbuild_id);
+					stmtSealBuild.bind(4, bi->buildname);
+					saved = stmtSealBuild.exec() > 0 || saved;
+				}
+				if (saved)
+					journal(server, mastername, *bi);
+				commit(false/*force*/);
+			}
+			return;
+		}
+
+		MSG(
+			"... saving the build #" << ++numSaved << ": "
+			<< mastername << "/" << bi->buildname
+			<< " with " << bi->numRecords() << " records"
+			<< ", with progress " << bi->progressPercentage() << " %"
+			<< " of " << bi->numQueued() << " queued packages"
+		)
+
+		TraceSpan span("write", "db", [&]() -> Trace::Args {return {{"masterbuild", mastername}, {"build", bi->buildname}, {"records", STR(bi->numRecords())}};});
+		auto started = std::chrono::steady_clock::now();
+		begin();
+
+		SQL_STMT(stmtSelectBuild, "SELECT id, ended FROM build WHERE masterbuild_id=? AND name=?")
+		SQL_STMT(stmtInsertBuild, "INSERT INTO build(masterbuild_id,name,started,ended,status,last_modified,etag,content_hash,sealed) VALUES(?,?,?,?,?,?,?,?,?)")
+		SQL_STMT(stmtUpdateBuild, "UPDATE build SET ended=?, status=?, last_modified=?, etag=?, content_hash=?, sealed=? WHERE id=?")
+
+		stmtSelectBuild.bind(1, masterbuild_id);
+		stmtSelectBuild.bind(2, bi->buildname);
+		const bool isNew = !stmtSelectBuild.executeStep();
+		if (isNew) { // need to insert
+			stmtInsertBuild.bind(1, masterbuild_id);
+			stmtInsertBuild.bind(2, bi->buildname);
+			stmtInsertBuild.bind(3, bi->started);
+			if (bi->ended != 0)
+				stmtInsertBuild.bind(4, bi->ended);
+			stmtInsertBuild.bind(5, bi->status);
+			stmtInsertBuild.bind(6, bi->last_modified);
+			if (!bi->etag.empty())
+				stmtInsertBuild.bind(7, bi->etag);
+			if (!bi->content_hash.empty())
+				stmtInsertBuild.bind(8, bi->content_hash);
+			stmtInsertBuild.bind(9, bi->isFinal() ? 1 : 0);
+			stmtInsertBuild.exec();
+			stmtSelectBuild.reset();
+			stmtSelectBuild.bind(1, masterbuild_id);
+			stmtSelectBuild.bind(2, bi->buildname);
+			(void)stmtSelectBuild.executeStep();
+		} else { // potentially need to update
+			if (bi->ended != 0)
+				stmtUpdateBuild.bind(1, bi->ended);
+			stmtUpdateBuild.bind(2, bi->status);
+			stmtUpdateBuild.bind(3, bi->last_modified);
+			if (!bi->etag.empty())
+				stmtUpdateBuild.bind(4, bi->etag);
+			if (!bi->content_hash.empty())
+				stmtUpdateBuild.bind(5, bi->content_hash);
+			stmtUpdateBuild.bind(6, bi->isFinal() ? 1 : 0);
+			stmtUpdateBuild.bind(7, (unsigned)stmtSelectBuild.getColumn(0));
+			stmtUpdateBuild.exec();
+		}
+		const unsigned build_id = stmtSelectBuild.getColumn(0);
+
+		// bring the per-port records to the new state: for existing builds only the rows that have changed are deleted or inserted
+		typedef BuildInfo BI;
+		typedef std::tuple<unsigned/*port_id*/, unsigned/*package_id*/, std::string> Row3;
+		typedef std::tuple<unsigned/*port_id*/, unsigned/*package_id*/, Time> RowBuilt;
+		typedef std::tuple<unsigned/*port_id*/, unsigned/*package_id*/, std::string, std::string, Time> RowFailed;
+		typedef std::tuple<unsigned/*port_id*/, unsigned/*package_id*/, unsigned/*depends_id*/> RowSkipped;
+		SyncStats stats;
+		PortStateChanges portStateChanges;
+
+		SQL_STMT(stmtSelectQueued, "SELECT port_id, package_id, reason FROM queued_data WHERE build_id=?")
+		SQL_STMT(stmtDeleteQueued, "DELETE FROM queued_data WHERE build_id=? AND port_id=? AND package_id=?")
+		SQL_STMT(stmtInsertQueued, "INSERT INTO queued_data VALUES(?,?,?,?)")
+		syncRecords<BI::Queued, Row3>(build_id, isNew, bi->queued, stats, stmtSelectQueued,
+			[this](const BI::Queued &r) {
+				return Row3{ports.id(r.origin), packages.id(r.pkgname), r.reason};
+			},
+			[](SQLite::Statement &stmt) {
+				return Row3{stmt.getColumn(0), stmt.getColumn(1), (std::string)stmt.getColumn(2)};
+			},
+			[&](const Row3 &row) {
+				stmtDeleteQueued.reset();
+				stmtDeleteQueued.bind(1, build_id);
+				stmtDeleteQueued.bind(2, std::get<0>(row));
+				stmtDeleteQueued.bind(3, std::get<1>(row));
+				stmtDeleteQueued.exec();
+			},
+			[&](const Row3 &row) {
+				stmtInsertQueued.reset();
+				stmtInsertQueued.bind(1, build_id);
+				stmtInsertQueued.bind(2, std::get<0>(row));
+				stmtInsertQueued.bind(3, std::get<1>(row));
+				stmtInsertQueued.bind(4, std::get<2>(row));
+				stmtInsertQueued.exec();
+			}
+		);
+
+		SQL_STMT(stmtSelectBuilt, "SELECT port_id, package_id, elapsed FROM built_data WHERE build_id=?")
+		SQL_STMT(stmtDeleteBuilt, "DELETE FROM built_data WHERE build_id=? AND port_id=? AND package_id=?")
+		SQL_STMT(stmtInsertBuilt, "INSERT INTO built_data VALUES(?,?,?,?)")
+		syncRecords<BI::Built, RowBuilt>(build_id, isNew, bi->built, stats, stmtSelectBuilt,
+			[this](const BI::Built &r) {
+				return RowBuilt{ports.id(r.origin), packages.id(r.pkgname), r.elapsed};
+			},
+			[](SQLite::Statement &stmt) {
+				return RowBuilt{stmt.getColumn(0), stmt.getColumn(1), (Time)stmt.getColumn(2)};
+			},
+			[&](const RowBuilt &row) {
+				stmtDeleteBuilt.reset();
+				stmtDeleteBuilt.bind(1, build_id);
+				stmtDeleteBuilt.bind(2, std::get<0>(row));
+				stmtDeleteBuilt.bind(3, std::get<1>(row));
+				stmtDeleteBuilt.exec();
+				portStateChanges.deleted.push_back(std::get<0>(row));
+			},
+			[&](const RowBuilt &row) {
+				stmtInsertBuilt.reset();
+				stmtInsertBuilt.bind(1, build_id);
+				stmtInsertBuilt.bind(2, std::get<0>(row));
+				stmtInsertBuilt.bind(3, std::get<1>(row));
+				stmtInsertBuilt.bind(4, std::get<2>(row));
+				stmtInsertBuilt.exec();
+				portStateChanges.built.push_back(std::get<0>(row));
+			}
+		);
+
+		SQL_STMT(stmtSelectFailed, "SELECT port_id, package_id, phase, errortype, elapsed FROM failed_data WHERE build_id=?")
+		SQL_STMT(stmtDeleteFailed, "DELETE FROM failed_data WHERE build_id=? AND port_id=? AND package_id=?")
+		SQL_STMT(stmtInsertFailed, "INSERT INTO failed_data VALUES(?,?,?,?,?,?)")
+		syncRecords<BI::Failed, RowFailed>(build_id, isNew, bi->failed, stats, stmtSelectFailed,
+			[this](const BI::Failed &r) {
+				return RowFailed{ports.id(r.origin), packages.id(r.pkgname), r.phase, r.errortype, r.elapsed};
+			},
+			[](SQLite::Statement &stmt) {
+				return RowFailed{stmt.getColumn(0), stmt.getColumn(1), (std::string)stmt.getColumn(2), (std::string)stmt.getColumn(3), (Time)stmt.getColumn(4)};
+			},
+			[&](const RowFailed &row) {
+				stmtDeleteFailed.reset();
+				stmtDeleteFailed.bind(1, build_id);
+				stmtDeleteFailed.bind(2, std::get<0>(row));
+				stmtDeleteFailed.bind(3, std::get<1>(row));
+				stmtDeleteFailed.exec();
+				portStateChanges.deleted.push_back(std::get<0>(row));
+			},
+			[&](const RowFailed &row) {
+				stmtInsertFailed.reset();
+				stmtInsertFailed.bind(1, build_id);
+				stmtInsertFailed.bind(2, std::get<0>(row));
+				stmtInsertFailed.bind(3, std::get<1>(row));
+				stmtInsertFailed.bind(4, std::get<2>(row));
+				stmtInsertFailed.bind(5, std::get<3>(row));
+				stmtInsertFailed.bind(6, std::get<4>(row));
+				stmtInsertFailed.exec();
+				portStateChanges.failed.push_back(std::get<0>(row));
+			}
+		);
+
+		SQL_STMT(stmtSelectIgnored, "SELECT port_id, package_id, reason FROM ignored_data WHERE build_id=?")
+		SQL_STMT(stmtDeleteIgnored, "DELETE FROM ignored_data WHERE build_id=? AND port_id=? AND package_id=? AND reason=?")
+		SQL_STMT(stmtInsertIgnored, "INSERT INTO ignored_data VALUES(?,?,?,?)")
+		syncRecords<BI::Ignored, Row3>(build_id, isNew, bi->ignored, stats, stmtSelectIgnored,
+			[this](const BI::Ignored &r) {
+				return Row3{ports.id(r.origin), packages.id(r.pkgname), r.reason};
+			},
+			[](SQLite::Statement &stmt) {
+				return Row3{stmt.getColumn(0), stmt.getColumn(1), (std::string)stmt.getColumn(2)};
+			},
+			[&](const Row3 &row) {
+				stmtDeleteIgnored.reset();
+				stmtDeleteIgnored.bind(1, build_id);
+				stmtDeleteIgnored.bind(2, std::get<0>(row));
+				stmtDeleteIgnored.bind(3, std::get<1>(row));
+				stmtDeleteIgnored.bind(4, std::get<2>(row));
+				stmtDeleteIgnored.exec();
+				portStateChanges.deleted.push_back(std::get<0>(row));
+			},
+			[&](const Row3 &row) {
+				stmtInsertIgnored.reset();
+				stmtInsertIgnored.bind(1, build_id);
+				stmtInsertIgnored.bind(2, std::get<0>(row));
+				stmtInsertIgnored.bind(3, std::get<1>(row));
+				stmtInsertIgnored.bind(4, std::get<2>(row));
+				stmtInsertIgnored.exec();
+				portStateChanges.ignored.push_back(std::get<0>(row));
+			}
+		);
+
+		SQL_STMT(stmtSelectSkipped, "SELECT port_id, package_id, depends_id FROM skipped_data WHERE build_id=?")
+		SQL_STMT(stmtDeleteSkipped, "DELETE FROM skipped_data WHERE build_id=? AND port_id=? AND package_id=? AND depends_id=?")
+		SQL_STMT(stmtInsertSkipped, "INSERT INTO skipped_data VALUES(?,?,?,?)")
+		syncRecords<BI::Skipped, RowSkipped>(build_id, isNew, bi->skipped, stats, stmtSelectSkipped,
+			[this](const BI::Skipped &r) {
+				return RowSkipped{ports.id(r.origin), packages.id(r.pkgname), packages.id(r.depends)};
+			},
+			[](SQLite::Statement &stmt) {
+				return RowSkipped{stmt.getColumn(0), stmt.getColumn(1), stmt.getColumn(2)};
+			},
+			[&](const RowSkipped &row) {
+				stmtDeleteSkipped.reset();
+				stmtDeleteSkipped.bind(1, build_id);
+				stmtDeleteSkipped.bind(2, std::get<0>(row));
+				stmtDeleteSkipped.bind(3, std::get<1>(row));
+				stmtDeleteSkipped.bind(4, std::get<2>(row));
+				stmtDeleteSkipped.exec();
+				portStateChanges.deleted.push_back(std::get<0>(row));
+			},
+			[&](const RowSkipped &row) {
+				stmtInsertSkipped.reset();
+				stmtInsertSkipped.bind(1, build_id);
+				stmtInsertSkipped.bind(2, std::get<0>(row));
+				stmtInsertSkipped.bind(3, std::get<1>(row));
+				stmtInsertSkipped.bind(4, std::get<2>(row));
+				stmtInsertSkipped.exec();
+				portStateChanges.skipped.push_back(std::get<0>(row));
+			}
+		);
+
+		// update the port states and the counts
+		updatePortState(masterbuild_id, build_id, bi->started, portStateChanges);
+		updateCounts(masterbuild_id, build_id, *bi);
+		journal(server, mastername, *bi);
+
+		if (!isNew)
+			MSG("... ... " << stats.inserted << " row(s) inserted, " << stats.deleted << " row(s) deleted, " << stats.unchanged << " row(s) unchanged")
+
+		// commit
+		commit(false/*force*/);
+
+		numRowsWritten += stats.inserted;
+		secondsWriting += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	}
+
+	void finish(bool interrupted = false) { // an interrupted bulk load is completed by the fetch that resumes it
+		TraceSpan span("finish", "db");
+		auto started = std::chrono::steady_clock::now();
+
+		// commit the last batch
+		commit(true/*force*/);
+
+		// complete the bulk load
+		if (bulkLoad) {
+			if (!interrupted) {
+				MSG("creating indexes")
+				db.exec(dbSchemaIndexes);
+
+				MSG("checking foreign keys")
+				if (SQLite::Statement(db, "PRAGMA foreign_key_check").executeStep())
+					FAIL("foreign key violations were found after the bulk load")
+			}
+
+			db.exec("PRAGMA synchronous = FULL");
+			db.exec("PRAGMA foreign_keys = ON");
+			db.resetStatements(); // the journal mode can't be changed while a read transaction is open
+			db.exec(STR("PRAGMA journal_mode = " << savedJournalMode)); // checkpoints and removes the -wal and -shm files unless it was WAL
+		}
+
+		secondsWriting += std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	}
+
+private:
+	std::map<std::string/*server*/, unsigned>                                            serverIds;
+	std::map<std::tuple<unsigned/*server_id*/, std::string/*masterbuild*/>, unsigned>    masterbuildIds;
+
+	struct Dictionary { // table(id, name) that maps names to integer ids, fully cached in memory
+		Dictionary(Database &db_, const std::string &table, const std::string &column)
+		: db(db_)
+		, stmtInsert(db, STR("INSERT INTO " << table << "(" << column << ") VALUES(?)"))
+		{
+			SQLite::Statement stmt(db, STR("SELECT id, " << column << " FROM " << table));
+			while (stmt.executeStep())
+				ids[stmt.getColumn(1)] = stmt.getColumn(0);
+		}
+		unsigned id(const std::string &name) { // adds missing names
+			auto i = ids.find(name);
+			if (i != ids.end())
+				return i->second;
+			stmtInsert.reset();
+			stmtInsert.bind(1, name);
+			stmtInsert.exec();
+			return ids[name] = db.getLastInsertRowid();
+		}
+	private:
+		Database                                    &db;
+		std::unordered_map<std::string, unsigned>   ids;
+		SQLite::Statement                           stmtInsert;
+	};
+	Dictionary ports;
+	Dictionary packages;
+
+	// transactions: one per build, or one per batch of builds in the bulk-load mode
+	const unsigned                         bulkLoadBatchSize;
+	std::unique_ptr<SQLite::Transaction>   transaction;
+	unsigned                               numBuildsInTransaction = 0;
+
+	void journal(const std::string &server, const std::string &mastername, const BuildInfo &bi) { // in the transaction that has saved the build
+		if (runId == 0)
+			return;
+		SQL_STMT(stmtInsertProgress, "INSERT OR IGNORE INTO fetch_progress(run_id, url) VALUES(?, ?)")
+		stmtInsertProgress.bind(1, runId);
+		stmtInsertProgress.bind(2, buildURL(server, mastername, bi.buildname));
+		stmtInsertProgress.exec();
+	}
+
+	void begin() {
+		if (!transaction)
+			transaction = std::make_unique<SQLite::Transaction>(db);
+	}
+	void commit(bool force) {
+		if (transaction && (force || !bulkLoad || ++numBuildsInTransaction >= bulkLoadBatchSize)) {
+			TraceSpan span("commit", "db");
+			auto started = std::chrono::steady_clock::now();
+			transaction->commit();
+			commitLatency.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+			transaction.reset();
+			numBuildsInTransaction = 0;
+		}
+	}
+
+	struct PortStateChanges { // ports with rows inserted into, or deleted from, the build
+		std::vector<unsigned> failed;
+		std::vector<unsigned> built;
+		std::vector<unsigned> ignored;
+		std::vector<unsigned> skipped;
+		std::vector<unsigned> deleted;
+	};
+
+	// port_state has the latest build of each masterbuild in which each port has failed, was built, ignored or skipped:
+	// new rows can only advance these, ports that had rows deleted have their state recomputed from the build history
+	void updatePortState(unsigned masterbuild_id, unsigned build_id, Time started, const PortStateChanges &changes) {
+		SQL_STMT(stmtFailed,
+			"INSERT INTO port_state(masterbuild_id, port_id, last_failed, last_failed_build_id) VALUES(?1, ?2, ?3, ?4)"
+			" ON CONFLICT(masterbuild_id, port_id) DO UPDATE SET last_failed = excluded.last_failed, last_failed_build_id = excluded.last_failed_build_id"
+			" WHERE last_failed IS NULL OR excluded.last_failed >= last_failed"
+		)
+		SQL_STMT(stmtBuilt,
+			"INSERT INTO port_state(masterbuild_id, port_id, last_succeeded) VALUES(?1, ?2, ?3)"
+			" ON CONFLICT(masterbuild_id, port_id) DO UPDATE SET last_succeeded = excluded.last_succeeded"
+			" WHERE last_succeeded IS NULL OR excluded.last_succeeded > last_succeeded"
+		)
+		SQL_STMT(stmtIgnored,
+			"INSERT INTO port_state(masterbuild_id, port_id, last_ignored) VALUES(?1, ?2, ?3)"
+			" ON CONFLICT(masterbuild_id, port_id) DO UPDATE SET last_ignored = excluded.last_ignored"
+			" WHERE last_ignored IS NULL OR excluded.last_ignored > last_ignored"
+		)
+		SQL_STMT(stmtSkipped,
+			"INSERT INTO port_state(masterbuild_id, port_id, last_skipped) VALUES(?1, ?2, ?3)"
+			" ON CONFLICT(masterbuild_id, port_id) DO UPDATE SET last_skipped = excluded.last_skipped"
+			" WHERE last_skipped IS NULL OR excluded.last_skipped > last_skipped"
+		)
+		SQL_STMT(stmtRecompute,
+			"INSERT OR REPLACE INTO port_state(masterbuild_id, port_id, last_failed_build_id, last_failed, last_succeeded, last_ignored, last_skipped)"
+			" SELECT ?1, ?2,"
+			" (SELECT b.id FROM failed_data d, build b WHERE d.port_id = ?2 AND b.id = d.build_id AND b.masterbuild_id = ?1 ORDER BY b.started DESC LIMIT 1),"
+			" (SELECT max(b.started) FROM failed_data d, build b WHERE d.port_id = ?2 AND b.id = d.build_id AND b.masterbuild_id = ?1),"
+			" (SELECT max(b.started) FROM built_data d, build b WHERE d.port_id = ?2 AND b.id = d.build_id AND b.masterbuild_id = ?1),"
+			" (SELECT max(b.started) FROM ignored_data d, build b WHERE d.port_id = ?2 AND b.id = d.build_id AND b.masterbuild_id = ?1),"
+			" (SELECT max(b.started) FROM skipped_data d, build b WHERE d.port_id = ?2 AND b.id = d.build_id AND b.masterbuild_id = ?1)"
+		)
+
+		auto advance = [masterbuild_id,started](SQLite::Statement &stmt, const std::vector<unsigned> &ports, unsigned build_id/*0 = not stored*/) {
+			for (auto port_id : ports) {
+				stmt.reset();
+				stmt.bind(1, masterbuild_id);
+				stmt.bind(2, port_id);
+				stmt.bind(3, started);
+				if (build_id != 0)
+					stmt.bind(4, build_id);
+				stmt.exec();
+			}
+		};
+		advance(stmtFailed, changes.failed, build_id);
+		advance(stmtBuilt, changes.built, 0);
+		advance(stmtIgnored, changes.ignored, 0);
+		advance(stmtSkipped, changes.skipped, 0);
+
+		for (auto port_id : std::set<unsigned>(changes.deleted.begin(), changes.deleted.end())) {
+			stmtRecompute.reset();
+			stmtRecompute.bind(1, masterbuild_id);
+			stmtRecompute.bind(2, port_id);
+			stmtRecompute.exec();
+		}
+	}
+
+	// build_counts has the totals of each build, masterbuild_counts has their sums: the difference with the previously stored
+	// build totals is added to the masterbuild totals
+	void updateCounts(unsigned masterbuild_id, unsigned build_id, const BuildInfo &bi) {
+		SQL_STMT(stmtSelect, "SELECT num_queued, num_built, num_failed, num_ignored, num_skipped, elapsed_built, elapsed_failed FROM build_counts WHERE build_id=?")
+		SQL_STMT(stmtReplace, "INSERT OR REPLACE INTO build_counts VALUES(?,?,?,?,?,?,?,?)")
+		SQL_STMT(stmtAdd,
+			"INSERT INTO masterbuild_counts VALUES(?,?,?,?,?,?,?,?,?)"
+			" ON CONFLICT(masterbuild_id) DO UPDATE SET"
+			" num_builds = num_builds + excluded.num_builds,"
+			" num_queued = num_queued + excluded.num_queued,"
+			" num_built = num_built + excluded.num_built,"
+			" num_failed = num_failed + excluded.num_failed,"
+			" num_ignored = num_ignored + excluded.num_ignored,"
+			" num_skipped = num_skipped + excluded.num_skipped,"
+			" elapsed_built = elapsed_built + excluded.elapsed_built,"
+			" elapsed_failed = elapsed_failed + excluded.elapsed_failed"
+		)
+
+		// new counts
+		std::array<int64_t, 7> counts = {
+			(int64_t)bi.queued.size(),
+			(int64_t)bi.built.size(),
+			(int64_t)bi.failed.size(),
+			(int64_t)bi.ignored.size(),
+			(int64_t)bi.skipped.size(),
+			0,
+			0
+		};
+		for (auto &built : bi.built)
+			counts[5] += built.elapsed;
+		for (auto &failed : bi.failed)
+			counts[6] += failed.elapsed;
+
+		// previous counts
+		std::array<int64_t, 7> prev = {};
+		stmtSelect.bind(1, build_id);
+		bool isNew = !stmtSelect.executeStep();
+		if (!isNew)
+			for (unsigned i = 0; i < prev.size(); i++)
+				prev[i] = stmtSelect.getColumn(i).getInt64();
+
+		// write
+		stmtReplace.bind(1, build_id);
+		for (unsigned i = 0; i < counts.size(); i++)
+			stmtReplace.bind(2 + i, counts[i]);
+		stmtReplace.exec();
+
+		stmtAdd.bind(1, masterbuild_id);
+		stmtAdd.bind(2, isNew ? 1 : 0);
+		for (unsigned i = 0; i < counts.size(); i++)
+			stmtAdd.bind(3 + i, counts[i] - prev[i]);
+		stmtAdd.exec();
+	}
+
+	struct SyncStats {
+		unsigned inserted = 0;
+		unsigned deleted = 0;
+		unsigned unchanged = 0;
+	};
+
+	// compares full rows: rows that are gone are deleted by their primary key, new or changed rows are inserted
+	template<typename T, typename Row>
+	static void syncRecords(
+		unsigned build_id,
+		bool isNew, // no rows can exist yet
+		const std::vector<T> &records,
+		SyncStats &stats,
+		SQLite::Statement &stmtSelect,
+		std::function<Row(const T &record)> rowOfRecord,
+		std::function<Row(SQLite::Statement &stmt)> rowOfSelected,
+		std::function<void(const Row &row)> deleteRow,
+		std::function<void(const Row &row)> insertRow
+	) {
+		// read existing rows
+		std::set<Row> existing;
+		if (!isNew) {
+			stmtSelect.bind(1, build_id);
+			while (stmtSelect.executeStep())
+				existing.insert(rowOfSelected(stmtSelect));
+		}
+
+		// find new rows, whatever remains in existing is gone
+		std::vector<Row> toInsert;
+		toInsert.reserve(isNew ? records.size() : 0);
+		for (auto &record : records) {
+			auto row = rowOfRecord(record);
+			auto i = existing.empty() ? existing.end() : existing.find(row);
+			if (i != existing.end()) {
+				existing.erase(i);
+				stats.unchanged++;
+			} else {
+				toInsert.push_back(std::move(row));
+			}
+		}
+
+		// delete first so that changed rows can be inserted again under the same primary key
+		for (auto &row : existing)
+			deleteRow(row);
+		for (auto &row : toInsert)
+			insertRow(row);
+
+		stats.deleted += existing.size();
+		stats.inserted += toInsert.size();
+	}
+
+
+	unsigned getServerId(const std::string &server) {
+		auto i = serverIds.find(server);
+		if (i != serverIds.end())
+			return i->second;
+
+		SQL_STMT(stmtInsertServer, "INSERT INTO server(url) VALUES(?)")
+		SQL_STMT(stmtSelectServer, "SELECT id FROM server WHERE url=?")
+		stmtSelectServer.bind(1, server);
+		if (!stmtSelectServer.executeStep()) {
+			stmtInsertServer.bind(1, server);
+			stmtInsertServer.exec();
+			stmtSelectServer.reset();
+			stmtSelectServer.bind(1, server);
+			(void)stmtSelectServer.executeStep();
+		}
+		return serverIds[server] = stmtSelectServer.getColumn(0);
+	}
+	unsigned getMasterbuildId(unsigned server_id, const std::string &masterbuild) {
+		auto i = masterbuildIds.find({server_id, masterbuild});
+		if (i != masterbuildIds.end())
+			return i->second;
+
+		// helpers
+		auto enableInitially = [](const std::string &masterbuild) {
+			bool disabled =
+				contains(masterbuild, "124") // obsolete
+				||
+				contains(masterbuild, "releng") // ignore release engineering builds - they are not regular and are sometimes stopped for extended periods of time
+				||
+				contains(masterbuild, "powerpc") // too many failures on powerpc compared to other archs
+				;
+
+			return !disabled;
+		};
+
+		SQL_STMT(stmtInsertMasterbuild, "INSERT INTO masterbuild(server_id,name,enabled) VALUES(?,?,?)")
+		SQL_STMT(stmtSelectMasterbuild, "SELECT id FROM masterbuild WHERE server_id=? AND name=?")
+
+		stmtSelectMasterbuild.bind(1, server_id);
+		stmtSelectMasterbuild.bind(2, masterbuild);
+		if (!stmtSelectMasterbuild.executeStep()) {
+			stmtInsertMasterbuild.bind(1, server_id);
+			stmtInsertMasterbuild.bind(2, masterbuild);
+			stmtInsertMasterbuild.bind(3, enableInitially(masterbuild) ? 1 : 0 /*enabled*/);
+			stmtInsertMasterbuild.exec();
+			stmtSelectMasterbuild.reset();
+			stmtSelectMasterbuild.bind(1, server_id);
+			stmtSelectMasterbuild.bind(2, masterbuild);
+			(void)stmtSelectMasterbuild.executeStep();
+		}
+		return masterbuildIds[{server_id, masterbuild}] = stmtSelectMasterbuild.getColumn(0);
+	}
+};
+
+struct PipelinedBuildWriter { // BuildWriter running in its own thread behind a bounded queue
+	PipelinedBuildWriter(BuildWriter &writer_, size_t queueDepth)
+	: writer(writer_)
+	, queue(queueDepth)
+	{
+		thread = std::thread([this]() {
+			Trace::ThreadName threadName("writer");
+			try {
+				Item item;
+				while (queue.pop(item)) {
+					writer.write(std::get<0>(item), std::get<1>(item), std::get<2>(item));
+					item = {}; // free the build records
+				}
+				writer.finish(interrupted);
+			} catch (...) {
+				error = std::current_exception();
+				queue.close(); // unblock producers
+			}
+		});
+	}
+	~PipelinedBuildWriter() {
+		if (thread.joinable()) {
+			queue.close();
+			thread.join();
+		}
+	}
+
+	void push(const std::string &server, const std::string &mastername, BuildInfoPtr bi) { // blocks while the queue is full
+		TraceSpan span("push", "db");
+		queue.push({server, mastername, bi});
+	}
+	void finish(bool interrupted_ = false) {
+		interrupted = interrupted_;
+		queue.close();
+		thread.join();
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+private:
+	typedef std::tuple<std::string/*server*/, std::string/*mastername*/, BuildInfoPtr> Item;
+
+	BuildWriter          &writer;
+	BoundedQueue<Item>   queue;
+	std::thread          thread;
+	std::exception_ptr   error;
+	std::atomic<bool>    interrupted{false}; // set before the queue is closed
+};
+
+//
 // main procedures
 //
 
-static std::set<std::string> fetchServerList() {
-	// retrieve the list of servers
-	auto serversStr = execCommand(
-		"set -euo pipefail\n"
-		"fetch -qo - \"https://pkg-status.freebsd.org/api/1/builds?type=package\" |"
-		"  jq -r \".. | select(.started? > $(date -v -2w +%s)) | .server\" | sort -u"
-	);
-	DEBUG("servers: " << serversStr)
+static std::set<std::string> fetchServerList(Database &db, FetchEngine &engine) {
+	TraceSpan span("server list", "fetch");
+	auto now = Time(::time(nullptr));
 
-	//serversStr = serversStr + "foul1\nfoul2";
+	// use the list from the previous discovery while it's fresh
+	auto ttl = envUnsigned("BUILDSDB_SERVER_LIST_TTL", 24*60*60);
+	if (ttl > 0) {
+		SQLite::Statement stmt(db, "SELECT url FROM server WHERE discovered = (SELECT max(discovered) FROM server) AND discovered >= ?");
+		stmt.bind(1, now - ttl);
+		std::set<std::string> serverURLs;
+		while (stmt.executeStep())
+			serverURLs.insert(stmt.getColumn(0));
+		if (!serverURLs.empty()) {
+			MSG("using the cached list of " << serverURLs.size() << " build servers")
+			return serverURLs;
+		}
+	}
 
-	// split string and decorate their names into URLs
+	// retrieve the list of servers that have started builds during the last 2 weeks
+	auto serverNames = Parser::parseRecentServers(
+		engine.fetch({STR(statusURL() << "/api/1/builds?type=package")}).content,
+		now - 14*24*60*60
+	);
+
+	// decorate their names into URLs
 	std::set<std::string> serverURLs;
-	for (auto s : splitString(serversStr, '\n'))
+	for (auto &s : serverNames)
 		//serverURLs.insert(STR("http://" << s << ".nyi.freebsd.org")); // via IPv6
-		serverURLs.insert(STR("https://pkg-status.freebsd.org/" << s)); // via IPv4
+		serverURLs.insert(STR(statusURL() << "/" << s)); // via IPv4
+
+	// check
+	if (serverURLs.empty())
+		FAIL("failed to fetch the build server list: it is empty")
+
+	// save the list
+	{
+		SQLite::Transaction transaction(db);
+		SQLite::Statement stmtInsert(db, "INSERT OR IGNORE INTO server(url) VALUES(?)");
+		SQLite::Statement stmtUpdate(db, "UPDATE server SET discovered=? WHERE url=?");
+		for (auto &url : serverURLs) {
+			stmtInsert.reset();
+			stmtInsert.bind(1, url);
+			stmtInsert.exec();
+			stmtUpdate.reset();
+			stmtUpdate.bind(1, now);
+			stmtUpdate.bind(2, url);
+			stmtUpdate.exec();
+		}
+		transaction.commit();
+	}
+
+	MSG("found " << serverURLs.size() << " build servers")
+
+	return serverURLs;
+}
+
+struct KnownBuilds { // versions of the builds in the DB: sealed builds are skipped, other builds are requested conditionally
+	struct Schedule { // adaptive polling
+		Time         next_poll = 0; // 0 means now
+		unsigned     poll_interval = 0;
+		bool         changed = false; // needs to be saved
+	};
+	struct Build {
+		std::string  last_modified;
+		std::string  etag;
+		std::string  content_hash;
+		bool         sealed = false;
+		Schedule     schedule;
+	};
+
+	// with adaptive polling (BUILDSDB_ADAPTIVE_POLLING=1), builds are only fetched when they are due: running builds often,
+	// with intervals that grow as far as the build is from its end, builds that don't change and idle masterbuilds rarely
+	const bool       adaptive = envUnsigned("BUILDSDB_ADAPTIVE_POLLING", 0) != 0;
+	const unsigned   minInterval = envUnsigned("BUILDSDB_POLL_MIN_INTERVAL", 5*60);
+	const unsigned   maxInterval = envUnsigned("BUILDSDB_POLL_MAX_INTERVAL", 6*60*60);
+
+	void load(Database &db) {
+		std::lock_guard<std::mutex> guard(mutex);
+		builds.clear();
+		masterbuilds.clear();
+		SQLite::Statement stmt(db, "SELECT m.name, b.name, b.last_modified, b.etag, b.content_hash, b.sealed, coalesce(b.next_poll, 0), coalesce(b.poll_interval, 0) FROM masterbuild m, build b WHERE m.id = b.masterbuild_id");
+		while (stmt.executeStep())
+			builds[stmt.getColumn(0)][stmt.getColumn(1)] = {
+				(std::string)stmt.getColumn(2), (std::string)stmt.getColumn(3), (std::string)stmt.getColumn(4), stmt.getColumn(5).getInt() != 0,
+				{Time(stmt.getColumn(6).getInt64()), unsigned(stmt.getColumn(7).getInt64())}
+			};
+		SQLite::Statement stmtMasterbuilds(db, "SELECT name, coalesce(next_poll, 0), coalesce(poll_interval, 0) FROM masterbuild");
+		while (stmtMasterbuilds.executeStep())
+			masterbuilds[stmtMasterbuilds.getColumn(0)] = {Time(stmtMasterbuilds.getColumn(1).getInt64()), unsigned(stmtMasterbuilds.getColumn(2).getInt64())};
+		loaded = true;
+	}
+	void clear() {
+		std::lock_guard<std::mutex> guard(mutex);
+		builds.clear();
+		masterbuilds.clear();
+		loaded = false;
+	}
+	bool isLoaded() const {
+		std::lock_guard<std::mutex> guard(mutex);
+		return loaded;
+	}
+
+	bool find(const std::string &mastername, const std::string &buildname, Build &build) const {
+		std::lock_guard<std::mutex> guard(mutex);
+		auto b = findBuild(mastername, buildname);
+		if (!b)
+			return false;
+		build = *b;
+		return true;
+	}
+
+	void update(const std::string &mastername, const BuildInfo &bi) { // the build is about to be written, keeps the versions in sync with the DB between fetches
+		std::lock_guard<std::mutex> guard(mutex);
+		auto &build = builds[mastername][bi.buildname];
+		if (!bi.waived || bi.unchanged) {
+			build.last_modified = bi.last_modified;
+			build.etag = bi.etag;
+			build.content_hash = bi.content_hash;
+		}
+		build.sealed = bi.isFinal();
+	}
+
+	// adaptive polling
+
+	bool isMasterbuildDue(const std::string &mastername, Time now) const { // its list of builds is due, or one of its builds is
+		if (!adaptive)
+			return true;
+		std::lock_guard<std::mutex> guard(mutex);
+		auto im = masterbuilds.find(mastername);
+		if (im == masterbuilds.end() || im->second.next_poll <= now)
+			return true;
+		auto ib = builds.find(mastername);
+		if (ib != builds.end())
+			for (auto &b : ib->second)
+				if (!b.second.sealed && b.second.schedule.next_poll <= now)
+					return true;
+		return false;
+	}
+	bool isBuildDue(const std::string &mastername, const BuildInfo &bi, Time now) const {
+		if (!adaptive || bi.isFinal()) // builds that have just ended are fetched to be sealed
+			return true;
+		std::lock_guard<std::mutex> guard(mutex);
+		auto b = findBuild(mastername, bi.buildname);
+		return !b || b->schedule.next_poll <= now;
+	}
+
+	void masterbuildPolled(const std::string &mastername, const std::vector<BuildInfoPtr> &bis, Time now) { // new builds reset the interval
+		if (!adaptive)
+			return;
+		std::lock_guard<std::mutex> guard(mutex);
+		bool hasNewBuilds = false;
+		for (auto &bi : bis)
+			if (!findBuild(mastername, bi->buildname))
+				hasNewBuilds = true;
+		auto &schedule = masterbuilds[mastername];
+		reschedule(schedule, hasNewBuilds ? minInterval : schedule.poll_interval*2, now);
+	}
+	void buildPolled(const std::string &mastername, const BuildInfo &bi, Time now) {
+		if (!adaptive)
+			return;
+		unsigned interval;
+		std::lock_guard<std::mutex> guard(mutex);
+		auto &schedule = builds[mastername][bi.buildname].schedule;
+		if (bi.waived) { // unchanged since the last poll: back off
+			interval = schedule.poll_interval*2;
+		} else { // changed: poll again within a fraction of the estimated remaining time
+			interval = minInterval;
+			auto progress = bi.progressPercentageQuiet(); // the writer warns about inconsistent records
+			if (progress > 0 && progress < 100 && bi.started != 0 && now > bi.started)
+				interval = unsigned(std::min<float>(float(now - bi.started)*(100 - progress)/progress/8, maxInterval));
+		}
+		reschedule(schedule, interval, now);
+	}
+
+	Time nextDue() const { // the earliest time when something is due, 0 when unknown
+		std::lock_guard<std::mutex> guard(mutex);
+		Time next = 0;
+		auto earlier = [&next](Time tm) {
+			if (next == 0 || tm < next)
+				next = tm;
+		};
+		for (auto &m : masterbuilds)
+			earlier(m.second.next_poll);
+		for (auto &m : builds)
+			for (auto &b : m.second)
+				if (!b.second.sealed)
+					earlier(b.second.schedule.next_poll);
+		return next;
+	}
+
+	void saveSchedule(Database &db) { // after all builds were written
+		if (!adaptive)
+			return;
+		std::lock_guard<std::mutex> guard(mutex);
+		SQLite::Transaction transaction(db);
+		auto &stmtMasterbuild = db.cachedStatement("UPDATE masterbuild SET next_poll=?, poll_interval=? WHERE name=?");
+		auto &stmtBuild = db.cachedStatement("UPDATE build SET next_poll=?, poll_interval=? WHERE masterbuild_id=(SELECT id FROM masterbuild WHERE name=?) AND name=?");
+		for (auto &m : masterbuilds)
+			if (m.second.changed) {
+				stmtMasterbuild.reset();
+				stmtMasterbuild.bind(1, m.second.next_poll);
+				stmtMasterbuild.bind(2, m.second.poll_interval);
+				stmtMasterbuild.bind(3, m.first);
+				stmtMasterbuild.exec();
+				m.second.changed = false;
+			}
+		for (auto &m : builds)
+			for (auto &b : m.second)
+				if (b.second.schedule.changed) {
+					stmtBuild.reset();
+					stmtBuild.bind(1, b.second.schedule.next_poll);
+					stmtBuild.bind(2, b.second.schedule.poll_interval);
+					stmtBuild.bind(3, m.first);
+					stmtBuild.bind(4, b.first);
+					stmtBuild.exec();
+					b.second.schedule.changed = false;
+				}
+		transaction.commit();
+	}
+
+private:
+	mutable std::mutex                                                                   mutex;
+	bool                                                                                 loaded = false;
+	std::map<std::string/*masterbuild*/, std::map<std::string/*buildname*/, Build>>     builds;
+	std::map<std::string/*masterbuild*/, Schedule>                                       masterbuilds;
+
+	const Build* findBuild(const std::string &mastername, const std::string &buildname) const {
+		auto im = builds.find(mastername);
+		if (im == builds.end())
+			return nullptr;
+		auto ib = im->second.find(buildname);
+		return ib != im->second.end() ? &ib->second : nullptr;
+	}
+
+	void reschedule(Schedule &schedule, unsigned interval, Time now) {
+		schedule.poll_interval = std::clamp(interval, minInterval, maxInterval);
+		schedule.next_poll = now + schedule.poll_interval;
+		schedule.changed = true;
+	}
+};
+
+struct ParseStats { // parsing of the build details, updated from the executor threads
+	std::atomic<uint64_t>   numBuilds{0};
+	std::atomic<uint64_t>   bytes{0};
+	std::atomic<uint64_t>   nanoseconds{0};
+	std::atomic<uint64_t>   numUnchanged{0}; // builds that weren't parsed because their content hash is the same as in the DB
+
+	void parseBuildDetails(const std::string &str, BuildInfo &bi, const std::string &mastername) {
+		TraceSpan span("parse", "parse", [&str]() -> Trace::Args {return {{"bytes", STR(str.size())}};});
+		auto started = std::chrono::steady_clock::now();
+		Parser::parseBuildDetails(str, bi, mastername);
+		nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count();
+		bytes += str.size();
+		numBuilds++;
+	}
+
+	double seconds() const {
+		return nanoseconds/1e9;
+	}
+	double secondsPerMB() const {
+		return bytes > 0 ? seconds()/(double(bytes)/(1024*1024)) : 0;
+	}
+};
+
+struct FetchFailure {
+	std::string   url;
+	std::string   error;
+};
+
+static std::vector<FetchFailure> fetchBuildInfo( // returns URLs that have failed, everything else is passed to the sink
+	const std::set<std::string> &servers,
+	KnownBuilds &knownBuilds, // to skip builds that are sealed, weren't changed or aren't due
+	const std::set<std::string> &savedURLs, // builds that the resumed fetch has already saved
+	FetchEngine &engine,
+	ParseStats &parseStats,
+	const BuildSink &sink
+) {
+	auto buildRequest = [&knownBuilds](const std::string &server, const std::string &mastername, const std::string &buildname) -> FetchRequest {
+		FetchRequest request{buildURL(server, mastername, buildname)};
+		request.needLastModified = true;
+		KnownBuilds::Build known;
+		if (knownBuilds.find(mastername, buildname, known)) {
+			request.knownLastModified = known.last_modified;
+			request.knownETag = known.etag;
+		}
+		return request;
+	};
+
+	// sealed builds are final in the DB, they are skipped without any request or write
+	std::atomic<unsigned> numSealed{0};
+	auto isSealed = [&knownBuilds,&numSealed](const std::string &mastername, const BuildInfoPtr &bi) {
+		KnownBuilds::Build known;
+		if (!knownBuilds.find(mastername, bi->buildname, known) || !known.sealed)
+			return false;
+		numSealed++;
+		return true;
+	};
+
+	// bodies that are byte-identical to the version in the DB are waived before parsing: servers sometimes only bump Last-Modified
+	auto isUnchanged = [&knownBuilds,&parseStats](const std::string &mastername, const BuildInfoPtr &bi, const std::string &content) {
+		bi->content_hash = formatHash(xxh64(content));
+		KnownBuilds::Build known;
+		if (!knownBuilds.find(mastername, bi->buildname, known) || known.content_hash != bi->content_hash)
+			return false;
+		bi->waived = bi->unchanged = true;
+		parseStats.numUnchanged++;
+		return true;
+	};
+
+	// a resumed fetch skips builds that it has saved before it was interrupted, without any request
+	std::atomic<unsigned> numSaved{0};
+	auto isSaved = [&savedURLs,&numSaved](const std::string &server, const std::string &mastername, const BuildInfoPtr &bi) {
+		if (savedURLs.find(buildURL(server, mastername, bi->buildname)) == savedURLs.end())
+			return false;
+		numSaved++;
+		return true;
+	};
+
+	// with adaptive polling, masterbuilds and builds that aren't due are skipped
+	auto now = Time(::time(nullptr));
+	std::atomic<unsigned> numMasterbuildsNotDue{0}, numBuildsNotDue{0};
+	auto isDue = [&knownBuilds,now,&numMasterbuildsNotDue,&numBuildsNotDue](const std::string &mastername, const BuildInfoPtr &bi) {
+		if (!bi ? knownBuilds.isMasterbuildDue(mastername, now) : knownBuilds.isBuildDue(mastername, *bi, now))
+			return true;
+		(!bi ? numMasterbuildsNotDue : numBuildsNotDue)++;
+		return false;
+	};
+
+	// a failure only affects the server, masterbuild or build that it has happened to, the rest of the fetch continues
+	std::mutex failuresMutex;
+	std::vector<FetchFailure> failures;
+	auto recordFailure = [&failuresMutex,&failures,&engine](const std::string &url) { // called from catch blocks
+		if (engine.isCancelled())
+			return; // the whole fetch has failed
+		std::string what;
+		try {
+			throw;
+		} catch (std::exception &e) {
+			what = e.what();
+		} catch (...) {
+			what = "unknown error";
+		}
+		WARNING("failed to fetch " << url << ": " << what)
+		std::lock_guard<std::mutex> guard(failuresMutex);
+		failures.push_back({url, what});
+	};
+
+	// run
+	if (::getenv("BUILDSDB_SEQUENTIAL")) {
+		MSG("sequential run")
+		// by server
+		for (auto &server : servers) {
+			TraceSpan span("server", "task", [&]() -> Trace::Args {return {{"server", server}};});
+			MSG("fetching data from the server " << server)
+
+			std::vector<std::string> masternames;
+			auto url = STR(server << "/data/.data.json");
+			try {
+				auto str = engine.fetch({url}).content;
+				DEBUG("JSON-STRING(server=" << server << ")=" << str)
+				masternames = Parser::parseServerMasterBuilds(F(json::parse(str), "masternames"));
+			} catch (...) {
+				recordFailure(url);
+				continue;
+			}
+
+			// for each master build on this server
+			for (auto &mastername : masternames) {
+				if (!isDue(mastername, nullptr))
+					continue;
+				TraceSpan span("masterbuild", "task", [&]() -> Trace::Args {return {{"server", server}, {"masterbuild", mastername}};});
+				MSG("... fetching builds for " << mastername << " from the server " << server)
+
+				// fetch data
+				std::vector<BuildInfoPtr> bis;
+				auto url = STR(server << "/data/" << mastername << "/.data.json");
+				try {
+					auto str = engine.fetch({url}).content;
+					DEBUG("JSON-STRING(server=" << server << " mastername=" << mastername << ")=" << str)
+
+					// check
+					if (str.rfind("<html>", 0) == 0)
+						continue; // skip the blank record
+
+					// parse JSON with build summary info
+					bis = Parser::parseBuildSummaries(F(json::parse(str), "builds"), mastername);
+				} catch (...) {
+					recordFailure(url);
+					continue;
+				}
+				sink(server, mastername, nullptr);
+				knownBuilds.masterbuildPolled(mastername, bis, now);
+				for (auto &bi : bis) {
+					// skip sealed builds, builds that were saved before the fetch was interrupted, and builds that aren't due
+					if (isSealed(mastername, bi) || isSaved(server, mastername, bi) || !isDue(mastername, bi))
+						continue;
+
+					// fetch data
+					auto request = buildRequest(server, mastername, bi->buildname);
+					auto url = request.url;
+					try {
+						auto result = engine.fetch(std::move(request));
+						bi->last_modified = result.lastModified;
+						bi->etag = result.etag;
+						DEBUG("JSON-STRING(server=" << server << " mastername=" << mastername << " buildname=" << bi->buildname << ")=" << result.content)
+
+						// parse JSON with build details
+						if (!(bi->waived = result.waived) && !isUnchanged(mastername, bi, result.content))
+							parseStats.parseBuildDetails(result.content, *bi, mastername);
+					} catch (...) {
+						recordFailure(url);
+						continue;
+					}
+					knownBuilds.buildPolled(mastername, *bi, now);
+
+					sink(server, mastername, bi);
+				}
+			}
+		}
+	} else { // PARALLELIZED
+		MSG("parallel run")
+
+		// network concurrency is governed by the fetch engine, executor threads only wait for the small
+		// server and masterbuild index files, and parse build details when they arrive
+		tf::Executor executor(std::max(8u, std::thread::hardware_concurrency()));
+		tf::Taskflow taskflow;
+
+		// the number of builds between their request and the sink is limited, so that fetched bodies
+		// and parsed records don't pile up when the sink applies backpressure
+		struct Window {
+			std::mutex                          mutex;
+			unsigned                            available;
+			std::deque<std::function<void()>>   deferred;
+
+			void submit(std::function<void()> &&start) {
+				{
+					std::lock_guard<std::mutex> guard(mutex);
+					if (available == 0) {
+						deferred.push_back(std::move(start));
+						return;
+					}
+					available--;
+				}
+				start();
+			}
+			void release() {
+				std::function<void()> start;
+				{
+					std::lock_guard<std::mutex> guard(mutex);
+					if (deferred.empty()) {
+						available++;
+						return;
+					}
+					start = std::move(deferred.front());
+					deferred.pop_front();
+				}
+				start();
+			}
+		} window;
+		window.available = envUnsigned("BUILDSDB_FETCH_WINDOW", 2*engine.getMaxInFlight());
+
+		// the first error in the asynchronous part other than a fetch failure is rethrown once everything has settled
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		auto saveError = [&errorMutex,&error]() {
+			std::lock_guard<std::mutex> guard(errorMutex);
+			if (!error)
+				error = std::current_exception();
+		};
+
+		for (auto &server : servers)
+			taskflow.emplace([server,&sink,&buildRequest,&isSealed,&isSaved,&isDue,&knownBuilds,now,&engine,&parseStats,&isUnchanged,&executor,&window,&recordFailure,&saveError](tf::Subflow &subflow) {
+				TraceSpan span("server", "task", [&]() -> Trace::Args {return {{"server", server}};});
+
+				// fetch data, and parse JSON with masterbuilds for this server
+				std::vector<std::string> masternames;
+				auto url = STR(server << "/data/.data.json");
+				try {
+					masternames = Parser::parseServerMasterBuilds(F(json::parse(engine.fetch({url}).content), "masternames"));
+				} catch (...) {
+					recordFailure(url);
+					return;
+				}
+
+				for (auto &mastername : masternames)
+					subflow.emplace([mastername,server,&sink,&buildRequest,&isSealed,&isSaved,&isDue,&knownBuilds,now,&engine,&parseStats,&isUnchanged,&executor,&window,&recordFailure,&saveError]() {
+						// check
+						if (!isDue(mastername, nullptr))
+							return;
+						TraceSpan span("masterbuild", "task", [&]() -> Trace::Args {return {{"server", server}, {"masterbuild", mastername}};});
+
+						// fetch data
+						std::vector<BuildInfoPtr> bis;
+						auto url = STR(server << "/data/" << mastername << "/.data.json");
+						try {
+							auto str = engine.fetch({url}).content;
+
+							// check
+							if (str.rfind("<html>", 0) == 0)
+								return; // skip the blank record
+
+							// parse JSON with build summary info
+							bis = Parser::parseBuildSummaries(F(json::parse(str), "builds"), mastername);
+						} catch (...) {
+							recordFailure(url);
+							return;
+						}
+						knownBuilds.masterbuildPolled(mastername, bis, now);
+						sink(server, mastername, nullptr);
+
+						// submit all builds in this masterbuild except sealed ones, already saved ones and ones that aren't due, their details are parsed by the executor as they arrive
+						for (auto &bi : bis)
+							if (!isSealed(mastername, bi) && !isSaved(server, mastername, bi) && isDue(mastername, bi))
+								window.submit([bi,server,mastername,request = buildRequest(server, mastername, bi->buildname),&sink,&knownBuilds,now,&engine,&parseStats,&isUnchanged,&executor,&window,&recordFailure,&saveError]() mutable {
+									auto url = request.url;
+									engine.fetchAsync(std::move(request), [bi,server,mastername,url,&sink,&knownBuilds,now,&parseStats,&isUnchanged,&executor,&window,&recordFailure,&saveError](FetchResult &&result) {
+										executor.silent_async([bi,server,mastername,url,&sink,&knownBuilds,now,&parseStats,&isUnchanged,&window,&recordFailure,&saveError,result = std::move(result)]() mutable {
+											TraceSpan span("build", "task", [&]() -> Trace::Args {return {{"server", server}, {"masterbuild", mastername}, {"build", bi->buildname}};});
+											try {
+												// check
+												if (!result.error.empty())
+													FAIL(result.error)
+
+												// parse JSON with build details
+												bi->last_modified = result.lastModified;
+												bi->etag = result.etag;
+												if (!(bi->waived = result.waived) && !isUnchanged(mastername, bi, result.content))
+													parseStats.parseBuildDetails(result.content, *bi, mastername);
+												result = {}; // free the body
+											} catch (...) {
+												recordFailure(url);
+												window.release();
+												return;
+											}
+											try {
+												knownBuilds.buildPolled(mastername, *bi, now);
+												sink(server, mastername, bi);
+											} catch (...) {
+												saveError();
+											}
+											window.release();
+										});
+									});
+								});
+					});
+			});
+
+		// run
+		executor.run(taskflow).wait();
+
+		// wait for the build details: drain the network, then the parsers, which in turn release deferred requests
+		do {
+			engine.waitIdle();
+			executor.wait_for_all();
+		} while (!engine.idle());
+
+		// rethrow
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	if (numSealed > 0)
+		MSG("skipped " << numSealed << " sealed build(s) without any request")
+	if (numSaved > 0)
+		MSG("skipped " << numSaved << " build(s) that were saved before the fetch was interrupted")
+	if (numMasterbuildsNotDue > 0 || numBuildsNotDue > 0)
+		MSG("skipped " << numMasterbuildsNotDue << " masterbuild(s) and " << numBuildsNotDue << " build(s) that aren't due for polling")
+
+	return failures;
+}
+
+static bool checkDbIsPresentWithMessage(const std::string &op) { // and that its schema is current: only fetch upgrades it
+	if (!Database::canOpenExistingDB()) {
+		PRINT("the '" << op << "' operation requires DB to be present, please run 'buildsdb fetch' first")
+		return false;
+	}
+	Database(false/*not create*/).checkSchemaVersion();
+
+	return true;
+}
+
+static bool stmtReturnsAnyRows(Database &db, const std::string &stmt) {
+	return SQLite::Statement(db, stmt).executeStep();
+}
+
+static size_t utf8Length(const std::string &str) {
+	size_t len = 0;
+	for (auto c : str)
+		if ((c & 0xc0) != 0x80)
+			len++;
+	return len;
+}
 
-	// check
-	if (serverURLs.empty())
-		FAIL("failed to fetch the build server list: it is empty")
+static void printTable(std::ostream &os, const std::vector<std::string> &header, const std::vector<std::vector<std::string>> &rows) {
+	// prints rows in the same format as sqlite3 in the table mode
+	auto numColumns = header.size();
+	if (rows.empty())
+		return;
 
-	MSG("found " << serverURLs.size() << " build servers")
+	// widths
+	std::vector<size_t> widths;
+	for (auto &h : header)
+		widths.push_back(utf8Length(h));
+	for (auto &row : rows)
+		for (unsigned c = 0; c < numColumns; c++)
+			widths[c] = std::max(widths[c], utf8Length(row[c]));
 
-	return serverURLs;
+	// print
+	auto line = [&]() {
+		for (auto w : widths)
+			os << '+' << std::string(w + 2, '-');
+		os << '+' << std::endl;
+	};
+	line();
+	for (unsigned c = 0; c < numColumns; c++) {
+		auto pad = widths[c] - utf8Length(header[c]);
+		os << "| " << std::string(pad/2, ' ') << header[c] << std::string(pad - pad/2, ' ') << ' ';
+	}
+	os << '|' << std::endl;
+	line();
+	for (auto &row : rows) {
+		for (unsigned c = 0; c < numColumns; c++)
+			os << "| " << row[c] << std::string(widths[c] - utf8Length(row[c]), ' ') << ' ';
+		os << '|' << std::endl;
+	}
+	line();
 }
 
-static void fetchBuildInfo(
-	const std::set<std::string> &servers,
-	BuildInfos &buildInfos,
-	Database &db // only to retrieve lastModified
-) {
-	// retrieve the build.last_modified field from DB so that we can skip builds that weren't changed
-	std::map<std::string/*masterbuild*/, std::map<std::string/*buildname*/, std::string/*last_modified*/>> lastModifiedInDB;
-	{
-		SQLite::Statement stmt(db, "SELECT m.name, b.name, b.last_modified FROM masterbuild m, build b WHERE m.id = b.masterbuild_id");
-		while (stmt.executeStep())
-			lastModifiedInDB[stmt.getColumn(0)][stmt.getColumn(1)] = (std::string)stmt.getColumn(2);
+static void printTable(std::ostream &os, SQLite::Statement &stmt) {
+	auto numColumns = stmt.getColumnCount();
+
+	// read rows
+	std::vector<std::string> header;
+	for (int c = 0; c < numColumns; c++)
+		header.push_back(stmt.getColumnName(c));
+	std::vector<std::vector<std::string>> rows;
+	while (stmt.executeStep()) {
+		rows.emplace_back();
+		for (int c = 0; c < numColumns; c++)
+			rows.back().push_back(stmt.getColumn(c).getText());
 	}
-	auto getLastModifiedInDB = [&lastModifiedInDB](const std::string &mastername, const std::string &buildname) -> const std::string* {
-		auto im = lastModifiedInDB.find(mastername);
-		if (im == lastModifiedInDB.end())
-			return nullptr;
-		auto ib = im->second.find(buildname);
-		if (ib != im->second.end())
-			return &ib->second;
-		else
-			return nullptr;
-	};
 
-	// run
-	if (::getenv("BUILDSDB_SEQUENTIAL")) {
-		MSG("sequential run")
-		// by server
-		for (auto &server : servers) {
-			MSG("fetching data from the server " << server)
+	printTable(os, header, rows);
+}
 
-			// info for this server
-			auto &buildInfo = buildInfos[server];
+static OutputFormat parseOutputFormat(const std::string &str) {
+	if (str == "table")
+		return FormatTable;
+	else if (str == "jsonl")
+		return FormatJsonLines;
+	else if (str == "csv")
+		return FormatCsv;
+	else if (str == "tsv")
+		return FormatTsv;
+	FAIL("unknown output format '" << str << "', the supported formats are: table, jsonl, csv, tsv")
+}
 
-			auto [waived, str] = fetchDataFromURL(STR(server << "/data/.data.json"));
-			DEBUG("JSON-STRING(server=" << server << ")=" << str)
+static void writeJsonString(std::ostream &os, const char *str) {
+	os << '"';
+	for (auto p = str; *p;) {
+		// unescaped run
+		auto e = p;
+		while ((unsigned char)*e >= 0x20 && *e != '"' && *e != '\\')
+			e++;
+		os.write(p, e - p);
+		if (!*e)
+			break;
+
+		// escaped character
+		switch (*e) {
+		case '"':  os << "\\\""; break;
+		case '\\': os << "\\\\"; break;
+		case '\n': os << "\\n"; break;
+		case '\r': os << "\\r"; break;
+		case '\t': os << "\\t"; break;
+		default: {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)*e);
+			os << buf;
+		}}
+		p = e + 1;
+	}
+	os << '"';
+}
 
-			// for each master build on this server
-			for (auto &mastername : Parser::parseServerMasterBuilds(F(json::parse(str), "masternames"))) {
-				MSG("... fetching builds for " << mastername << " from the server " << server)
+static void writeCsvField(std::ostream &os, const char *str) {
+	if (!std::strpbrk(str, ",\"\r\n")) {
+		os << str;
+		return;
+	}
+	os << '"';
+	for (auto p = str; *p;) {
+		auto e = std::strchr(p, '"');
+		if (!e) {
+			os << p;
+			break;
+		}
+		os.write(p, e - p + 1) << '"'; // the quote is doubled
+		p = e + 1;
+	}
+	os << '"';
+}
 
-				// fetch data
-				auto [waived, str] = fetchDataFromURL(STR(server << "/data/" << mastername << "/.data.json"));
-				DEBUG("JSON-STRING(server=" << server << " mastername=" << mastername << ")=" << str)
+static void writeTsvField(std::ostream &os, const char *str) {
+	for (auto p = str; *p;) {
+		auto e = p + std::strcspn(p, "\t\n\r\\");
+		os.write(p, e - p);
+		if (!*e)
+			break;
+		switch (*e) {
+		case '\t': os << "\\t"; break;
+		case '\n': os << "\\n"; break;
+		case '\r': os << "\\r"; break;
+		case '\\': os << "\\\\"; break;
+		}
+		p = e + 1;
+	}
+}
 
-				// check
-				if (str.rfind("<html>", 0) == 0)
-					continue; // skip the blank record
+static void printRows(std::ostream &os, SQLite::Statement &stmt, OutputFormat format) {
+	// the table needs all rows for column widths, other formats are written row by row as the rows are produced
+	if (format == FormatTable) {
+		printTable(os, stmt);
+		return;
+	}
 
-				// parse JSON with build summary info
-				for (auto &bi : buildInfo[mastername] = Parser::parseBuildSummaries(F(json::parse(str), "builds"), mastername)) {
-					// fetch data
-					auto [waived, str] = fetchDataFromURL(
-						STR(server << "/data/" << mastername << "/" << bi->buildname << "/.data.json"),
-						getLastModifiedInDB(mastername, bi->buildname),
-						&bi->last_modified
-					);
-					DEBUG("JSON-STRING(server=" << server << " mastername=" << mastername << " buildname=" << bi->buildname << ")=" << str)
-
-					// parse JSON with build details
-					if (!(bi->waived = waived))
-						Parser::parseBuildDetails(json::parse(str), *bi, mastername);
-				}
+	auto numColumns = stmt.getColumnCount();
+
+	// header
+	std::vector<std::string> jsonKeys;
+	for (int c = 0; c < numColumns; c++) {
+		std::ostringstream ss;
+		switch (format) {
+		case FormatJsonLines:
+			writeJsonString(ss, stmt.getColumnName(c));
+			jsonKeys.push_back(ss.str() + ":");
+			break;
+		case FormatCsv:
+			os << (c == 0 ? "" : ",");
+			writeCsvField(os, stmt.getColumnName(c));
+			break;
+		case FormatTsv:
+			os << (c == 0 ? "" : "\t");
+			writeTsvField(os, stmt.getColumnName(c));
+			break;
+		default:
+			break;
+		}
+	}
+	if (format == FormatCsv)
+		os << "\r\n";
+	else if (format == FormatTsv)
+		os << '\n';
+
+	// rows
+	bool first = true;
+	while (stmt.executeStep()) {
+		if (format == FormatJsonLines)
+			os << '{';
+		for (int c = 0; c < numColumns; c++) {
+			auto column = stmt.getColumn(c);
+			switch (format) {
+			case FormatJsonLines:
+				os << (c == 0 ? "" : ",") << jsonKeys[c];
+				if (column.isNull())
+					os << "null";
+				else if (column.isInteger() || column.isFloat())
+					os << column.getText();
+				else
+					writeJsonString(os, column.getText());
+				break;
+			case FormatCsv:
+				os << (c == 0 ? "" : ",");
+				writeCsvField(os, column.getText());
+				break;
+			case FormatTsv:
+				os << (c == 0 ? "" : "\t");
+				writeTsvField(os, column.getText());
+				break;
+			default:
+				break;
 			}
 		}
-	} else { // PARALLELIZED
-		MSG("parallel run")
+		if (format == FormatJsonLines)
+			os << "}\n";
+		else if (format == FormatCsv)
+			os << "\r\n";
+		else
+			os << '\n';
 
-		tf::Executor executor(32); // the bottleneck is mostly due to network fetch speed, not CPU, so choose a high number here
-		tf::Taskflow taskflow;
+		// the first row is delivered right away, the rest is buffered
+		if (first) {
+			os.flush();
+			first = false;
+		}
+	}
+	os.flush();
+}
 
-		std::mutex buildInfosMutex;
+static void printSelectResult(Database &db, const std::string &selectSql) {
+	printTable(std::cout, db.cachedStatement(selectSql));
+}
 
-		for (auto &server : servers)
-			taskflow.emplace([server,&buildInfos,&buildInfosMutex,&getLastModifiedInDB](tf::Subflow &subflow) {
-				// fetch data
-				auto [waived, str] = fetchDataFromURL(STR(server << "/data/.data.json"));
+static void forEachStatement(Database &db, const std::string &script, unsigned numArgs, std::function<void(const std::string &text, const std::vector<unsigned> &params)> fn) {
+	// statements are prepared one by one after the previous ones have run, because they can depend on them, like on ATTACH
+	const char *sql = script.c_str();
+	while (*sql) {
+		// find the next statement and its ?N parameters
+		sqlite3_stmt *pstmt = nullptr;
+		const char *tail = nullptr;
+		if (sqlite3_prepare_v2(db.getHandle(), sql, -1, &pstmt, &tail) != SQLITE_OK)
+			FAIL("SQL error: " << sqlite3_errmsg(db.getHandle()))
+		std::string text(sql, tail - sql);
+		sql = tail;
+		if (!pstmt) // only whitespace or comments
+			continue;
+		std::vector<unsigned> params;
+		for (unsigned a = 1; a <= numArgs; a++)
+			if (sqlite3_bind_parameter_index(pstmt, CSTR("?" << a)) != 0)
+				params.push_back(a);
+		sqlite3_finalize(pstmt);
+
+		fn(text, params);
+	}
+}
 
-				// parse JSON with masterbuilds for this server
-				for (auto &mastername : Parser::parseServerMasterBuilds(F(json::parse(str), "masternames")))
-					subflow.emplace([mastername,server,&buildInfos,&buildInfosMutex,&getLastModifiedInDB](tf::Subflow &subflow) {
-						// fetch data
-						auto [waived, str] = fetchDataFromURL(STR(server << "/data/" << mastername << "/.data.json"));
+static void runScript(Database &db, const std::string &script, const std::vector<std::string> &args, OutputFormat format, std::ostream &os) {
+	// arguments are bound to the ?N parameters, results of the statements that return rows are printed
+	forEachStatement(db, script, args.size(), [&](const std::string &text, const std::vector<unsigned> &params) {
+		auto &stmt = db.cachedStatement(text);
+		for (auto a : params)
+			stmt.bind(a, args[a - 1]);
+		if (stmt.getColumnCount() > 0)
+			printRows(os, stmt, format);
+		else
+			stmt.exec();
+	});
+}
 
-						// check
-						if (str.rfind("<html>", 0) == 0)
-							return; // skip the blank record
+//
+// query profiler
+//
+
+struct QueryProfile {
+	struct Statement {
+		std::string   text;
+		uint64_t      rows = 0;
+		double        seconds = 0;
+		int           fullScanSteps = 0;
+		int           sorts = 0;
+		int           autoIndexes = 0;
+		int           vmSteps = 0;
+		std::string   plan;
+	};
+	std::vector<Statement>               statements;
+	std::map<std::string, std::string>   viewPlans; // views used by the statements, directly or through other views
+	double                               wallSeconds = 0;
+	double                               cpuSeconds = 0;
+	int                                  cacheHits = 0;
+	int                                  cacheMisses = 0;
+
+	uint64_t rows() const {
+		uint64_t sum = 0;
+		for (auto &s : statements)
+			sum += s.rows;
+		return sum;
+	}
+	int sum(int Statement::*counter) const {
+		int sum = 0;
+		for (auto &s : statements)
+			sum += s.*counter;
+		return sum;
+	}
+	std::string cacheHitRate() const {
+		return cacheHits + cacheMisses > 0 ? STR(std::fixed << std::setprecision(1) << 100.*cacheHits/(cacheHits + cacheMisses) << " %") : "n/a";
+	}
+};
 
-						// parse JSON with build summary info
-						auto bis = Parser::parseBuildSummaries(F(json::parse(str), "builds"), mastername);
+static double cpuSeconds() {
+	struct rusage ru;
+	::getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec)/1e6;
+}
 
-						{ // save build info objects into buildInfos
-							std::lock_guard<std::mutex> guard(buildInfosMutex);
-							buildInfos[server][mastername] = bis;
-						}
+static std::string explainQueryPlan(Database &db, const std::string &sql) { // the plan tree in the same format as sqlite3 prints it
+	SQLite::Statement stmt(db, "EXPLAIN QUERY PLAN " + sql);
+	std::map<int/*parent*/, std::vector<std::tuple<int/*id*/, std::string/*detail*/>>> children;
+	while (stmt.executeStep())
+		children[stmt.getColumn(1).getInt()].push_back({stmt.getColumn(0).getInt(), stmt.getColumn(3).getString()});
+
+	std::ostringstream ss;
+	ss << "QUERY PLAN" << std::endl;
+	std::function<void(int, const std::string&)> print = [&](int parent, const std::string &prefix) {
+		auto &nodes = children[parent];
+		for (unsigned n = 0; n < nodes.size(); n++) {
+			bool last = n + 1 == nodes.size();
+			ss << prefix << (last ? "`--" : "|--") << std::get<1>(nodes[n]) << std::endl;
+			print(std::get<0>(nodes[n]), prefix + (last ? "   " : "|  "));
+		}
+	};
+	print(0, "");
+	return ss.str();
+}
 
-						// process all builds in this masterbuild
-						for (auto &bi : bis)
-							subflow.emplace([bi,server,mastername,&getLastModifiedInDB]() {
-								// fetch data
-								auto [waived, str] = fetchDataFromURL(
-									STR(server << "/data/" << mastername << "/" << bi->buildname << "/.data.json"),
-									getLastModifiedInDB(mastername, bi->buildname),
-									&bi->last_modified
-								);
-
-								// parse JSON with build details
-								if (!(bi->waived = waived))
-									Parser::parseBuildDetails(json::parse(str), *bi, mastername);
-							});
-					});
-			});
+static QueryProfile profileScript(Database &db, const std::string &script, const std::vector<std::string> &args) {
+	// runs the script like runScript does, but instead of printing rows counts them and collects counters, times and query plans
+	QueryProfile profile;
+	auto h = db.getHandle();
+	int cur, hiwtr;
+	sqlite3_db_status(h, SQLITE_DBSTATUS_CACHE_HIT, &cur, &hiwtr, 1/*reset*/);
+	sqlite3_db_status(h, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hiwtr, 1/*reset*/);
+	auto wallStarted = std::chrono::steady_clock::now();
+	auto cpuStarted = cpuSeconds();
+
+	std::set<std::string> views;
+	forEachStatement(db, script, args.size(), [&](const std::string &text, const std::vector<unsigned> &params) {
+		QueryProfile::Statement ps;
+		ps.text = text;
+		auto started = std::chrono::steady_clock::now();
+
+		// prepare: the authorizer reports the views through which tables are accessed
+		sqlite3_set_authorizer(h, [](void *views, int, const char*, const char*, const char*, const char *view) {
+			if (view)
+				static_cast<std::set<std::string>*>(views)->insert(view);
+			return SQLITE_OK;
+		}, &views);
+		sqlite3_stmt *pstmt = nullptr;
+		int rc = sqlite3_prepare_v2(h, text.c_str(), -1, &pstmt, nullptr);
+		sqlite3_set_authorizer(h, nullptr, nullptr);
+		if (rc != SQLITE_OK)
+			FAIL("SQL error: " << sqlite3_errmsg(h))
+		std::unique_ptr<sqlite3_stmt, int(*)(sqlite3_stmt*)> stmtGuard(pstmt, sqlite3_finalize);
 
 		// run
-		executor.run(taskflow).wait();
-	}
+		for (auto a : params)
+			sqlite3_bind_text(pstmt, a, args[a - 1].c_str(), -1, SQLITE_TRANSIENT);
+		while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW)
+			ps.rows++;
+		if (rc != SQLITE_DONE)
+			FAIL("SQL error: " << sqlite3_errmsg(h))
+		ps.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+		// counters
+		ps.fullScanSteps = sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+		ps.sorts         = sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_SORT, 0);
+		ps.autoIndexes   = sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_AUTOINDEX, 0);
+		ps.vmSteps       = sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+
+		// plan
+		if (sqlite3_stmt_readonly(pstmt) && sqlite3_column_count(pstmt) > 0)
+			ps.plan = explainQueryPlan(db, text);
+
+		profile.statements.push_back(ps);
+	});
+
+	profile.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStarted).count();
+	profile.cpuSeconds = cpuSeconds() - cpuStarted;
+	sqlite3_db_status(h, SQLITE_DBSTATUS_CACHE_HIT, &profile.cacheHits, &hiwtr, 0);
+	sqlite3_db_status(h, SQLITE_DBSTATUS_CACHE_MISS, &profile.cacheMisses, &hiwtr, 0);
+
+	// plans of the views on their own
+	for (auto &view : views)
+		profile.viewPlans[view] = explainQueryPlan(db, STR("SELECT * FROM \"" << view << "\""));
+
+	return profile;
 }
 
-static unsigned writeBuildInfoToDB(const BuildInfos &buildInfos, Database &db) {
-	MSG("saving builds into the database")
+static void printProfile(std::ostream &os, const QueryProfile &profile) {
+	auto ms = [](double seconds) {
+		return STR(std::fixed << std::setprecision(1) << seconds*1000 << " ms");
+	};
 
-	// helpers
-	auto enableInitially = [](const std::string &masterbuild) {
-		bool disabled =
-			contains(masterbuild, "124") // obsolete
-			||
-			contains(masterbuild, "releng") // ignore release engineering builds - they are not regular and are sometimes stopped for extended periods of time
-			||
-			contains(masterbuild, "powerpc") // too many failures on powerpc compared to other archs
-			;
+	unsigned n = 0;
+	for (auto &ps : profile.statements) {
+		os << "Statement #" << ++n << ":" << std::endl;
+		std::istringstream text(ps.text);
+		for (std::string line; std::getline(text, line);)
+			if (!line.empty())
+				os << "    " << line << std::endl;
+		os << "  time:             " << ms(ps.seconds) << std::endl;
+		os << "  rows:             " << ps.rows << std::endl;
+		os << "  full scan steps:  " << ps.fullScanSteps << std::endl;
+		os << "  sorts:            " << ps.sorts << std::endl;
+		os << "  auto-indexes:     " << ps.autoIndexes << std::endl;
+		os << "  VM steps:         " << ps.vmSteps << std::endl;
+		if (!ps.plan.empty())
+			os << ps.plan;
+		os << std::endl;
+	}
+	for (auto &vp : profile.viewPlans)
+		os << "View " << vp.first << ":" << std::endl << vp.second << std::endl;
+	os << "Total:" << std::endl;
+	os << "  wall time:        " << ms(profile.wallSeconds) << std::endl;
+	os << "  CPU time:         " << ms(profile.cpuSeconds) << std::endl;
+	os << "  page cache:       " << profile.cacheHits << " hit(s), " << profile.cacheMisses << " miss(es), hit rate " << profile.cacheHitRate() << std::endl;
+}
 
-		return !disabled;
-	};
+//
+// main action functions
+//
 
-	// enable foreign keys
-	db.exec("PRAGMA foreign_keys = ON"); // this doesn't cause performance problem practically, otheriwse PRAGMA foreign_key_check; should be run in the end
+static void writeMetrics(const FetchEngine &engine, const ParseStats &parseStats, const BuildWriter &writer, size_t numFailures, double wallSeconds) {
+	// written when requested: BUILDSDB_METRICS_JSON as a JSON document, BUILDSDB_METRICS_PROM for the Prometheus textfile collector
+	auto jsonPath = ::getenv("BUILDSDB_METRICS_JSON");
+	auto promPath = ::getenv("BUILDSDB_METRICS_PROM");
+	if (!jsonPath && !promPath)
+		return;
 
-	// update the server table
-	for (auto &i : buildInfos) {
-		auto const &server = i.first;
+	auto perSecond = [](double num, double seconds) {
+		return seconds > 0 ? num/seconds : 0;
+	};
+	auto writeAtomically = [](const std::string &path, const std::string &content) { // collectors can read the file at any moment
+		writeFile(path + ".tmp", content);
+		fs::rename(path + ".tmp", path);
+	};
 
-		SQL_STMT(stmtInsertServer, "INSERT INTO server(url) VALUES(?)")
-		SQL_STMT(stmtSelectServer, "SELECT id FROM server WHERE url=?")
-		stmtSelectServer.bind(1, server);
-		if (!stmtSelectServer.executeStep()) {
-			stmtInsertServer.bind(1, server);
-			stmtInsertServer.exec();
-		}
+	if (jsonPath) {
+		json servers = json::object();
+		for (auto &s : engine.serverStats)
+			servers[s.first] = {
+				{"requests", s.second.numRequests},
+				{"bytes_on_wire", s.second.bytesOnWire},
+				{"seconds", s.second.seconds},
+				{"bytes_per_second", perSecond(s.second.bytesOnWire, s.second.seconds)}
+			};
+		json j = {
+			{"timestamp", ::time(nullptr)},
+			{"wall_seconds", wallSeconds},
+			{"max_rss_bytes", maxRssBytes()},
+			{"fetch", {
+				{"requests", engine.numRequests.load()},
+				{"waived", engine.numWaived.load()},
+				{"errors", engine.numErrors.load()},
+				{"retries", engine.numRetries.load()},
+				{"failed_urls", numFailures},
+				{"bytes_on_wire", engine.bytesOnWire.load()},
+				{"bytes_decoded", engine.bytesDecoded.load()},
+				{"latency_seconds", engine.latency.toJson()}
+			}},
+			{"servers", servers},
+			{"parse", {
+				{"builds", parseStats.numBuilds.load()},
+				{"bytes", parseStats.bytes.load()},
+				{"seconds", parseStats.seconds()},
+				{"seconds_per_mb", parseStats.secondsPerMB()},
+				{"unchanged", parseStats.numUnchanged.load()}
+			}},
+			{"write", {
+				{"builds", writer.numSaved},
+				{"rows", writer.numRowsWritten},
+				{"seconds", writer.secondsWriting},
+				{"rows_per_second", perSecond(writer.numRowsWritten, writer.secondsWriting)},
+				{"commit_latency_seconds", writer.commitLatency.toJson()}
+			}}
+		};
+		writeAtomically(jsonPath, j.dump(2) + "\n");
 	}
 
-	// global vars
-	unsigned bno = 0;
+	if (promPath) {
+		std::ostringstream ss;
+		auto gauge = [&ss](const char *name, const char *help, double value) {
+			ss << "# HELP " << name << " " << help << std::endl;
+			ss << "# TYPE " << name << " gauge" << std::endl;
+			ss << name << " " << value << std::endl;
+		};
+		auto serverGauge = [&ss,&engine](const char *name, const char *help, std::function<double(const FetchEngine::ServerStats&)> value) {
+			ss << "# HELP " << name << " " << help << std::endl;
+			ss << "# TYPE " << name << " gauge" << std::endl;
+			for (auto &s : engine.serverStats) {
+				std::string label;
+				for (auto chr : s.first)
+					label += chr == '\\' || chr == '"' ? std::string("\\") + chr : std::string(1, chr);
+				ss << name << "{server=\"" << label << "\"} " << value(s.second) << std::endl;
+			}
+		};
+		ss << std::setprecision(10);
+		gauge("buildsdb_fetch_timestamp_seconds", "Time when the last fetch has completed.", ::time(nullptr));
+		gauge("buildsdb_fetch_wall_seconds", "Duration of the last fetch.", wallSeconds);
+		gauge("buildsdb_fetch_max_rss_bytes", "Peak resident set size of the last fetch.", maxRssBytes());
+		gauge("buildsdb_fetch_requests", "HTTP requests made by the last fetch.", engine.numRequests);
+		gauge("buildsdb_fetch_waived", "Requests of the last fetch that found the data not modified.", engine.numWaived);
+		gauge("buildsdb_fetch_errors", "Requests of the last fetch that have failed after all retries.", engine.numErrors);
+		gauge("buildsdb_fetch_retries", "Retries of failed requests by the last fetch.", engine.numRetries);
+		gauge("buildsdb_fetch_failed_urls", "URLs that the last fetch has failed to fetch or to parse.", numFailures);
+		gauge("buildsdb_fetch_bytes_on_wire", "Bytes received by the last fetch, before the content decoding.", engine.bytesOnWire);
+		gauge("buildsdb_fetch_bytes_decoded", "Bytes received by the last fetch, after the content decoding.", engine.bytesDecoded);
+		engine.latency.writePrometheus(ss, "buildsdb_fetch_request_duration_seconds", "Latency of HTTP requests of the last fetch.");
+		serverGauge("buildsdb_fetch_server_requests", "HTTP requests made to the server by the last fetch.", [](auto &s) {return s.numRequests;});
+		serverGauge("buildsdb_fetch_server_bytes_on_wire", "Bytes received from the server by the last fetch.", [](auto &s) {return s.bytesOnWire;});
+		serverGauge("buildsdb_fetch_server_throughput_bytes_per_second", "Bytes received from the server per second of transfer time.", [&perSecond](auto &s) {return perSecond(s.bytesOnWire, s.seconds);});
+		gauge("buildsdb_parse_bytes", "Bytes of build details parsed by the last fetch.", parseStats.bytes);
+		gauge("buildsdb_parse_seconds", "Time spent parsing build details by the last fetch.", parseStats.seconds());
+		gauge("buildsdb_parse_seconds_per_megabyte", "Time spent parsing a MiB of build details.", parseStats.secondsPerMB());
+		gauge("buildsdb_parse_unchanged_builds", "Builds of the last fetch that weren't parsed because their content hash was the same as in the DB.", parseStats.numUnchanged);
+		gauge("buildsdb_write_builds", "Builds saved by the last fetch.", writer.numSaved);
+		gauge("buildsdb_write_rows", "Rows inserted by the last fetch.", writer.numRowsWritten);
+		gauge("buildsdb_write_seconds", "Time spent writing into the database by the last fetch.", writer.secondsWriting);
+		gauge("buildsdb_write_rows_per_second", "Rows inserted per second of writing by the last fetch.", perSecond(writer.numRowsWritten, writer.secondsWriting));
+		writer.commitLatency.writePrometheus(ss, "buildsdb_write_commit_duration_seconds", "Latency of transaction commits of the last fetch.");
+		writeAtomically(promPath, ss.str());
+	}
+}
 
-	unsigned numberBuildsToSave = 0;
-	for (auto s : buildInfos)
-		for (auto &m : s.second)
-			for (auto &bi : m.second)
-				if (!bi->waived)
-					numberBuildsToSave++;
+struct FetchSession { // fetches into the DB, keeping the network connections, the versions of known builds and the writer caches between fetches
+	FetchSession(Database &db_, bool offline = false)
+	: db(db_)
+	, engine(offline)
+	{
+		// create or upgrade schema, an empty DB is loaded in the bulk-load mode, an interrupted bulk load continues in it
+		auto run = db.tableExists("fetch_run") ? findInterruptedRun() : std::make_tuple(int64_t(0), false);
+		bulkLoad = std::get<0>(run) != 0
+			? std::get<1>(run)
+			: !stmtReturnsAnyRows(db, "SELECT name FROM sqlite_master WHERE type='table' AND name='build'") && !::getenv("BUILDSDB_NO_BULK_LOAD");
+		db.createSchema(bulkLoad/*deferIndexes*/);
+		if (bulkLoad)
+			MSG((std::get<0>(run) != 0 ? "resuming the bulk load of the database" : "the database is empty: loading it in the bulk-load mode"))
+	}
 
-	// update masterbuild, build, and further tables
-	for (auto &s : buildInfos) {
-		// get server_id
-		SQL_STMT(stmtSelectServer, "SELECT id FROM server WHERE url=?")
-		stmtSelectServer.bind(1, s.first);
-		stmtSelectServer.executeStep();
-		const unsigned server_id = stmtSelectServer.getColumn(0);
+	std::vector<FetchFailure> fetch() { // returns URLs that have failed, everything else is saved
+		auto started = std::chrono::steady_clock::now();
+		Trace trace(::getenv("BUILDSDB_TRACE")); // records the timeline until the fetch returns
 
-		// by masterbuilds on this server
-		for (auto &m : s.second) {
-			SQL_STMT(stmtInsertMasterbuild, "INSERT INTO masterbuild(server_id,name,enabled) VALUES(?,?,?)")
-			SQL_STMT(stmtSelectMasterbuild, "SELECT id FROM masterbuild WHERE server_id=? AND name=?")
+		try {
+			// state
+			if (!knownBuilds.isLoaded())
+				knownBuilds.load(db);
+			if (!writer)
+				writer = std::make_unique<BuildWriter>(db, bulkLoad);
+			engine.resetStatistics();
+			writer->resetStatistics();
+
+			// the run is journaled: builds are recorded in fetch_progress as they are committed, so that when the fetch
+			// is interrupted the next one resumes it and skips them, the run ends once all builds were passed to the writer
+			std::set<std::string> savedURLs;
+			int64_t runId = std::get<0>(findInterruptedRun());
+			if (runId != 0) {
+				SQLite::Statement stmt(db, "SELECT url FROM fetch_progress WHERE run_id=?");
+				stmt.bind(1, runId);
+				while (stmt.executeStep())
+					savedURLs.insert(stmt.getColumn(0));
+				if (bulkLoad) { // the writer has found the DB in WAL that the interrupted run switched it to
+					SQLite::Statement stmtMode(db, "SELECT journal_mode FROM fetch_run WHERE id=?");
+					stmtMode.bind(1, runId);
+					if (stmtMode.executeStep() && !stmtMode.getColumn(0).isNull())
+						writer->savedJournalMode = stmtMode.getColumn(0).getString();
+				}
+				MSG("resuming the interrupted fetch #" << runId << " that has saved " << savedURLs.size() << " build(s)")
+			} else {
+				SQLite::Statement stmt(db, "INSERT INTO fetch_run(started, bulk_load, journal_mode) VALUES(?, ?, ?)");
+				stmt.bind(1, int64_t(::time(nullptr)));
+				stmt.bind(2, bulkLoad ? 1 : 0);
+				if (bulkLoad)
+					stmt.bind(3, writer->savedJournalMode);
+				stmt.exec();
+				runId = db.getLastInsertRowid();
+			}
+			writer->runId = runId;
+
+			// fetch the build server list
+			auto servers = fetchServerList(db, engine);
+
+			// fetch build info and write it into the DB: builds flow through a bounded queue into the writer thread,
+			// so that network, parsing and DB writes overlap and the memory use doesn't depend on the amount of data
+			ParseStats parseStats;
+			std::vector<FetchFailure> failures;
+			auto sink = [this](const std::string &server, const std::string &mastername, BuildInfoPtr bi, const std::function<void()> &write) {
+				if (bi)
+					knownBuilds.update(mastername, *bi);
+				write();
+			};
+			if (::getenv("BUILDSDB_SEQUENTIAL")) {
+				failures = fetchBuildInfo(servers, knownBuilds, savedURLs, engine, parseStats, [this,&sink](const std::string &server, const std::string &mastername, BuildInfoPtr bi) {
+					sink(server, mastername, bi, [&]() {
+						writer->write(server, mastername, bi);
+					});
+				});
+				writer->finish(engine.isCancelled());
+			} else {
+				PipelinedBuildWriter pipelinedWriter(*writer, envUnsigned("BUILDSDB_WRITE_QUEUE_DEPTH", 16));
+				failures = fetchBuildInfo(servers, knownBuilds, savedURLs, engine, parseStats, [&sink,&pipelinedWriter](const std::string &server, const std::string &mastername, BuildInfoPtr bi) {
+					sink(server, mastername, bi, [&]() {
+						pipelinedWriter.push(server, mastername, bi);
+					});
+				});
+				pipelinedWriter.finish(engine.isCancelled());
+			}
 
-			stmtSelectMasterbuild.bind(1, server_id);
-			stmtSelectMasterbuild.bind(2, m.first/*masterbuild*/);
-			if (!stmtSelectMasterbuild.executeStep()) {
-				stmtInsertMasterbuild.bind(1, server_id);
-				stmtInsertMasterbuild.bind(2, m.first/*masterbuild_name*/);
-				stmtInsertMasterbuild.bind(3, enableInitially(m.first) ? 1 : 0 /*enabled*/);
-				stmtInsertMasterbuild.exec();
-				stmtSelectMasterbuild.reset();
-				stmtSelectMasterbuild.bind(1, server_id);
-				stmtSelectMasterbuild.bind(2, m.first/*masterbuild*/);
-				(void)stmtSelectMasterbuild.executeStep();
+			// a cancelled run isn't ended: what was written is kept, and the next fetch resumes the run
+			if (engine.isCancelled())
+				FAIL("the fetch was cancelled after saving " << writer->numSaved << " build(s), the next fetch resumes it")
+			knownBuilds.saveSchedule(db);
+			endRun(runId);
+
+			// report
+			MSG("fetched " << engine.summary())
+			if (parseStats.numBuilds > 0)
+				MSG("parsed " << parseStats.numBuilds << " build(s), " << formatBytes(parseStats.bytes) << " in " << parseStats.seconds() << " sec")
+			if (parseStats.numUnchanged > 0)
+				MSG("skipped parsing " << parseStats.numUnchanged << " build(s) with the same content hash as in the database")
+			if (writer->numRowsWritten > 0)
+				MSG(
+					"wrote " << writer->numRowsWritten << " row(s) in " << writer->secondsWriting << " sec"
+					<< " (" << uint64_t(writer->numRowsWritten/writer->secondsWriting) << " rows/sec)"
+				)
+			writeMetrics(engine, parseStats, *writer, failures.size(), std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+			if (failures.empty()) {
+				MSG("successfully imported " << writer->numSaved << " build(s) from " << servers.size() << " server(s)")
+			} else {
+				MSG("imported " << writer->numSaved << " build(s) from " << servers.size() << " server(s), failed to fetch " << failures.size() << " URL(s):")
+				for (auto &f : failures)
+					PRINT("  " << f.url << ": " << f.error)
 			}
-			const unsigned masterbuild_id = stmtSelectMasterbuild.getColumn(0);
-
-			// by builds for this masterbuild
-			for (auto &bi : m.second)
-				if (!bi->waived) {
-					MSG(
-						"... saving the build #" << ++bno << " of " << numberBuildsToSave << ": "
-						<< m.first << "/" << bi->buildname
-						<< " with " << bi->numRecords() << " records"
-						<< ", with progress " << bi->progressPercentage() << " %"
-						<< " of " << bi->numQueued() << " queued packages"
-					)
-
-					SQL_STMT(stmtSelectBuild, "SELECT id, ended FROM build WHERE masterbuild_id=? AND name=?")
-					SQL_STMT(stmtInsertBuild, "INSERT INTO build(masterbuild_id,name,started,ended,status,last_modified) VALUES(?,?,?,?,?,?)")
-					SQL_STMT(stmtUpdateBuild, "UPDATE build SET ended=?, status=?, last_modified=? WHERE id=?")
-
-					stmtSelectBuild.bind(1, masterbuild_id);
-					stmtSelectBuild.bind(2, bi->buildname);
-					if (!stmtSelectBuild.executeStep()) { // need to insert
-						stmtInsertBuild.bind(1, masterbuild_id);
-						stmtInsertBuild.bind(2, bi->buildname);
-						stmtInsertBuild.bind(3, bi->started);
-						if (bi->ended != 0)
-							stmtInsertBuild.bind(4, bi->ended);
-						stmtInsertBuild.bind(5, bi->status);
-						stmtInsertBuild.bind(6, bi->last_modified);
-						stmtInsertBuild.exec();
-						stmtSelectBuild.reset();
-						stmtSelectBuild.bind(1, masterbuild_id);
-						stmtSelectBuild.bind(2, bi->buildname);
-						(void)stmtSelectBuild.executeStep();
-					} else { // potentially need to update
-						if (bi->ended != 0)
-							stmtUpdateBuild.bind(1, bi->ended);
-						stmtUpdateBuild.bind(2, bi->status);
-						stmtUpdateBuild.bind(3, bi->last_modified);
-						stmtUpdateBuild.bind(4, (unsigned)stmtSelectBuild.getColumn(0));
-						stmtUpdateBuild.exec();
-					}
-					const unsigned build_id = stmtSelectBuild.getColumn(0);
-
-					// delete old and insert new records per-port
-
-					SQLite::Transaction transaction(db);
-
-					// delete old records
-					//SQL_STMT(stmtDeleteTobuild, "DELETE FROM tobuild WHERE build_id=?")
-					SQL_STMT(stmtDeleteQueued,  "DELETE FROM queued WHERE build_id=?")
-					SQL_STMT(stmtDeleteBuilt,   "DELETE FROM built WHERE build_id=?")
-					SQL_STMT(stmtDeleteFailed,  "DELETE FROM failed WHERE build_id=?")
-					SQL_STMT(stmtDeleteIgnored, "DELETE FROM ignored WHERE build_id=?")
-					SQL_STMT(stmtDeleteSkipped, "DELETE FROM skipped WHERE build_id=?")
-					for (auto stmt : {/*&stmtDeleteTobuild,*/ &stmtDeleteQueued, &stmtDeleteBuilt, &stmtDeleteFailed, &stmtDeleteIgnored, &stmtDeleteSkipped}) {
-						stmt->bind(1, build_id);
-						stmt->exec();
-					}
 
-					// insert new records
-					//for (auto &tobuild : bi->tobuild) {
-					//	SQL_STMT(stmtInsertTobuild, "INSERT INTO tobuild VALUES(?,?,?)")
-					//	stmtInsertTobuild.bind(1, build_id);
-					//	stmtInsertTobuild.bind(2, tobuild.origin);
-					//	stmtInsertTobuild.bind(3, tobuild.pkgname);
-					//	stmtInsertTobuild.exec();
-					//}
-					for (auto &queued : bi->queued) {
-						SQL_STMT(stmtInsertQueued, "INSERT INTO queued VALUES(?,?,?,?)")
-						stmtInsertQueued.bind(1, build_id);
-						stmtInsertQueued.bind(2, queued.origin);
-						stmtInsertQueued.bind(3, queued.pkgname);
-						stmtInsertQueued.bind(4, queued.reason);
-						stmtInsertQueued.exec();
-					}
-					for (auto &built : bi->built) {
-						SQL_STMT(stmtInsertBuilt, "INSERT INTO built VALUES(?,?,?,?)")
-						stmtInsertBuilt.bind(1, build_id);
-						stmtInsertBuilt.bind(2, built.origin);
-						stmtInsertBuilt.bind(3, built.pkgname);
-						stmtInsertBuilt.bind(4, built.elapsed);
-						stmtInsertBuilt.exec();
-					}
-					for (auto &failed : bi->failed) {
-						SQL_STMT(stmtInsertFailed, "INSERT INTO failed VALUES(?,?,?,?,?,?)")
-						stmtInsertFailed.bind(1, build_id);
-						stmtInsertFailed.bind(2, failed.origin);
-						stmtInsertFailed.bind(3, failed.pkgname);
-						stmtInsertFailed.bind(4, failed.phase);
-						stmtInsertFailed.bind(5, failed.errortype);
-						stmtInsertFailed.bind(6, failed.elapsed);
-						stmtInsertFailed.exec();
-					}
-					for (auto &ignored : bi->ignored) {
-						SQL_STMT(stmtInsertIgnored, "INSERT INTO ignored VALUES(?,?,?,?)")
-						stmtInsertIgnored.bind(1, build_id);
-						stmtInsertIgnored.bind(2, ignored.origin);
-						stmtInsertIgnored.bind(3, ignored.pkgname);
-						stmtInsertIgnored.bind(4, ignored.reason);
-						stmtInsertIgnored.exec();
-					}
-					for (auto &skipped : bi->skipped) {
-						SQL_STMT(stmtInsertSkipped, "INSERT INTO skipped VALUES(?,?,?,?)")
-						stmtInsertSkipped.bind(1, build_id);
-						stmtInsertSkipped.bind(2, skipped.origin);
-						stmtInsertSkipped.bind(3, skipped.pkgname);
-						stmtInsertSkipped.bind(4, skipped.depends);
-						stmtInsertSkipped.exec();
-					}
+			// the bulk-load writer is only used once
+			if (bulkLoad) {
+				writer.reset();
+				bulkLoad = false;
+			}
 
-					// commit
-					transaction.commit();
-				} else {
-					//MSG("DB: YES waived masterbuild=" << m.first << "/" << bi->buildname)
-				}
+			return failures;
+		} catch (...) {
+			// the state can be ahead of the DB, it is reloaded by the next fetch
+			knownBuilds.clear();
+			writer.reset(); // rolls back the open transaction
+			throw;
 		}
 	}
 
-	return numberBuildsToSave; // number of saved builds
-}
-
-static bool checkDbIsPresentWithMessage(const std::string &op) {
-	if (!Database::canOpenExistingDB()) {
-		PRINT("the '" << op << "' operation requires DB to be present, please run 'buildsdb fetch' first")
-		return false;
+	void cancel() { // from any thread: the fetch in progress, if any, stops, and the fetches after it fail
+		engine.cancel();
 	}
 
-	return true;
-}
+	Time nextDue() const { // with adaptive polling, 0 otherwise
+		return knownBuilds.adaptive ? knownBuilds.nextDue() : 0;
+	}
 
-static bool stmtReturnsAnyRows(Database &db, const std::string &stmt) {
-	return SQLite::Statement(db, stmt).executeStep();
-}
+private:
+	std::tuple<int64_t/*id*/, bool/*bulk_load*/> findInterruptedRun() { // the latest run that hasn't ended, 0 when none
+		SQLite::Statement stmt(db, "SELECT id, bulk_load FROM fetch_run WHERE ended IS NULL ORDER BY id DESC LIMIT 1");
+		if (!stmt.executeStep())
+			return {0, false};
+		return {stmt.getColumn(0).getInt64(), stmt.getColumn(1).getInt() != 0};
+	}
+	void endRun(int64_t runId) { // the run is kept as the history of fetches, its progress isn't needed anymore
+		SQLite::Transaction transaction(db);
+		SQLite::Statement stmtEnd(db, "UPDATE fetch_run SET ended=? WHERE id=?");
+		stmtEnd.bind(1, int64_t(::time(nullptr)));
+		stmtEnd.bind(2, runId);
+		stmtEnd.exec();
+		SQLite::Statement stmtDelete(db, "DELETE FROM fetch_progress WHERE run_id=?");
+		stmtDelete.bind(1, runId);
+		stmtDelete.exec();
+		transaction.commit();
+	}
 
-static void printSelectResult(const std::string &selectSql) {
-	auto res = ::system(CSTR(
-		"(echo .mode table; echo '" << selectSql << "') | sqlite3 " << dbPath()
-	));
-	if (res != 0)
-		FAIL("SQL query failed to execute")
-}
+	Database                       &db;
+	bool                           bulkLoad;
+	FetchEngine                    engine;
+	KnownBuilds                    knownBuilds;
+	std::unique_ptr<BuildWriter>   writer;
+};
 
-//
-// main action functions
-//
+static int doFetch(bool offline) {
+	// check
+	if (offline && !::getenv("BUILDSDB_CACHE_DIR"))
+		FAIL("the offline fetch needs the response cache, please set BUILDSDB_CACHE_DIR")
 
-static int doFetch() {
 	// message
-	if (Database::canOpenExistingDB())
+	if (offline)
+		MSG("performing an offline fetch from the response cache")
+	else if (Database::canOpenExistingDB())
 		MSG("performing an incremental fetch when only the updates and new builds will be fetched")
 	else
 		MSG("no BuildsDB database was found, performing a complete fetch - this can take up to 20 minutes")
@@ -1069,33 +3768,24 @@ static int doFetch() {
 	// DB object
 	Database db(true/*create*/);
 
-	// create schema
-	db.exec(dbSchema);
-
-	// fetch the build server list
-	auto servers = fetchServerList();
-
-	// we parse all data into this structure first
-	BuildInfos buildInfos; // [by-server][by-masterbuild]
-
-	// fetch build info
-	fetchBuildInfo(servers, buildInfos, db);
-
-	// write build info to DB
-	auto numBuilds = writeBuildInfoToDB(buildInfos, db);
-
-	MSG("successfully imported " << numBuilds << " build(s) from " << servers.size() << " server(s)")
-
-	return EXIT_SUCCESS;
+	// fetch: what was fetched is saved even when some URLs have failed
+	FetchSession session(db, offline);
+	return session.fetch().empty() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 static int usage(bool fail) {
 	PRINT("usage:")
-	PRINT("   buildsdb fetch")
+	PRINT("   buildsdb fetch {|--offline}")
+	PRINT("   or")
+	PRINT("   buildsdb serve")
+	PRINT("   or")
+	PRINT("   buildsdb query [--format={table|jsonl|csv|tsv}] {query-name} {args...}")
+	PRINT("   or")
+	PRINT("   buildsdb query --profile {query-name} {args...}")
 	PRINT("   or")
-	PRINT("   buildsdb query {query-name} {args...}")
+	PRINT("   buildsdb query --profile-all")
 	PRINT("   or")
-	PRINT("   buildsdb stats")
+	PRINT("   buildsdb stats {|tables}")
 	PRINT("   or")
 	PRINT("   buildsdb show-masterbuilds {|enable|disable}")
 	PRINT("   or")
@@ -1108,7 +3798,52 @@ static int usage(bool fail) {
 	return fail ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-static int doStats() {
+static int doStats(bool tables) {
+	// checks
+	if (!checkDbIsPresentWithMessage("stats"))
+		return EXIT_FAILURE;
+
+	// DB object
+	Database db(false/*not create*/);
+
+	// counts
+	auto countColumns = [](const char *prefix) {
+		return STR(
+			"sum(" << prefix << "num_queued) AS Queued, "
+			"sum(" << prefix << "num_built) AS Built, "
+			"sum(" << prefix << "num_failed) AS Failed, "
+			"sum(" << prefix << "num_ignored) AS Ignored, "
+			"sum(" << prefix << "num_skipped) AS Skipped, "
+			"round(sum(" << prefix << "elapsed_built)/3600.0, 1) AS BuiltHours, "
+			"round(sum(" << prefix << "elapsed_failed)/3600.0, 1) AS FailedHours"
+		);
+	};
+	PRINT("Totals:")
+	printSelectResult(db, STR(
+		"SELECT (SELECT count(*) FROM server) AS Servers, (SELECT count(*) FROM masterbuild) AS Masterbuilds, sum(num_builds) AS Builds, "
+		<< countColumns("") << ", (SELECT count(*) FROM port) AS Ports, (SELECT count(*) FROM package) AS Packages"
+		" FROM masterbuild_counts"
+	));
+	PRINT("Totals by masterbuild:")
+	printSelectResult(db, STR(
+		"SELECT m.name AS Masterbuild, m.enabled AS Enabled, sum(c.num_builds) AS Builds, " << countColumns("c.") <<
+		" FROM masterbuild m LEFT JOIN masterbuild_counts c ON c.masterbuild_id = m.id GROUP BY m.id ORDER BY m.name"
+	));
+
+	// sizes
+	PRINT("Database size:")
+	printSelectResult(db,
+		"SELECT p.page_count * s.page_size AS Bytes, p.page_count AS Pages, f.freelist_count AS FreePages"
+		" FROM pragma_page_count() p, pragma_page_size() s, pragma_freelist_count() f"
+	);
+	if (tables) { // dbstat reads every page, so this isn't printed by default
+		PRINT("Sizes of tables and indexes:")
+		printSelectResult(db,
+			"SELECT name AS Name, sum(pgsize) AS Bytes, sum(ncell) AS Cells, count(*) AS Pages"
+			" FROM dbstat GROUP BY name ORDER BY sum(pgsize) DESC"
+		);
+	}
+
 	return EXIT_SUCCESS;
 }
 
@@ -1119,8 +3854,6 @@ static int doEnableMasterbuilds(const std::vector<std::string> &masterbuild_patt
 	for (auto &pattern : masterbuild_patterns) {
 		if (pattern.empty())
 			FAIL("masterbuld pattern can't be empty")
-		if (contains(pattern, '\''))
-			FAIL("masterbuld pattern can't contain the ' (quote) character")
 	}
 
 	// expand patterns
@@ -1135,14 +3868,15 @@ static int doEnableMasterbuilds(const std::vector<std::string> &masterbuild_patt
 		else
 			masterbuild_patterns_expanded.push_back(pattern);
 
-	{ // execute queries
-		Database db(false/*not create*/);
+	// execute queries
+	Database db(false/*not create*/);
+	{
 		SQLite::Transaction transaction(db);
 		for (auto &pattern : masterbuild_patterns_expanded) {
-			SQLite::Statement(
-				db,
-				STR("UPDATE masterbuild SET enabled=" << (enable ? '1' : '0') << " WHERE name LIKE '%" << pattern << "%'")
-			).exec();
+			auto &stmt = db.cachedStatement("UPDATE masterbuild SET enabled=? WHERE name LIKE '%' || ? || '%'");
+			stmt.bind(1, enable ? 1 : 0);
+			stmt.bind(2, pattern);
+			stmt.exec();
 			PRINT("Masterbuilds *" << pattern << "* were " << (enable ? "enabled" : "disabled") << ".")
 		}
 		transaction.commit();
@@ -1150,7 +3884,7 @@ static int doEnableMasterbuilds(const std::vector<std::string> &masterbuild_patt
 
 	// show enabled
 	PRINT("The list of currently 'enabled' flags for masterbuilds is:")
-	printSelectResult("SELECT name AS Masterbuild, enabled AS Enabled FROM masterbuild ORDER BY name");
+	printSelectResult(db, "SELECT name AS Masterbuild, enabled AS Enabled FROM masterbuild ORDER BY name");
 
 	return EXIT_SUCCESS;
 }
@@ -1161,81 +3895,371 @@ static int doShowMasterbuilds(YesNoAny yna) {
 		return EXIT_FAILURE;
 
 	// print
+	Database db(false/*not create*/);
 	if (yna == Any)
-		printSelectResult("SELECT name AS Masterbuild, enabled AS Enabled FROM masterbuild ORDER BY name");
+		printSelectResult(db, "SELECT name AS Masterbuild, enabled AS Enabled FROM masterbuild ORDER BY name");
 	else
-		printSelectResult(STR("SELECT name AS Masterbuild, enabled AS Enabled FROM masterbuild WHERE enabled=" << (yna == Yes ? '1' : '0') << " ORDER BY name"));
+		printSelectResult(db, STR("SELECT name AS Masterbuild, enabled AS Enabled FROM masterbuild WHERE enabled=" << (yna == Yes ? '1' : '0') << " ORDER BY name"));
 
 	return EXIT_SUCCESS;
 }
 
-static int doQuery(const std::string &name, const std::vector<std::string> &args) {
-	// DB object
-	Database db(true/*create*/);
+static void prepareQuery(Database &db, const Queries::Query &query, const std::vector<std::string> &args) {
+	// check if PortsDB is needed and present
+	if (fileContainsString(query.path.string(), "ports.sqlite")) {
+		if (!canOpenExistingPortsDB())
+			FAIL("this query needs PortsDB, please install it with 'sudo pkg install portsdb', and fetch it with 'portsdb-import'")
+		if (!fileExists("ports.sqlite"))
+			fs::create_symlink(dbPathPortsDB(), "ports.sqlite");
+	}
+
+	// check that the number of arguments matches
+	if (args.size() != query.args.size())
+		FAIL("supplied " << args.size() << " argument(s) for the query expecting " << query.args.size() << " argument(s): " << query)
+
+	// validate arguments if needed
+	for (unsigned a = 0; a < args.size(); a++) {
+		auto aname = query.args[a];
+		auto aval = args[a];
+		auto exists = [&db,&aval](const char *sql) {
+			auto &stmt = db.cachedStatement(sql);
+			stmt.bind(1, aval);
+			return stmt.executeStep();
+		};
+		if (aname == "port-origin") {
+			if (!exists("SELECT id FROM port WHERE origin=?"))
+				FAIL("'" << aval << "' isn't a valid port")
+		} else if (aname == "masterbuild-name") {
+			if (!exists("SELECT id FROM masterbuild WHERE name=? LIMIT 1"))
+				FAIL("masterbuild '" << aval << "' doesn't exist")
+		} else if (aname == "build-name") {
+			if (!exists("SELECT id FROM build WHERE name=? LIMIT 1"))
+				FAIL("build '" << aval << "' doesn't exist")
+		} // we don't fail for other argument names since they might be added later
+	}
+}
+
+static bool sampleQueryArgs(Database &db, const Queries::Query &query, std::vector<std::string> &args) {
+	// picks representative argument values from the DB: the latest build of the enabled masterbuilds and a port that failed in it
+	std::string masterbuild, build, port;
+	{
+		auto &stmt = db.cachedStatement("SELECT m.name, b.name, b.id FROM masterbuild m, build b WHERE b.masterbuild_id = m.id AND m.enabled = 1 ORDER BY b.started DESC LIMIT 1");
+		if (stmt.executeStep()) {
+			masterbuild = stmt.getColumn(0).getString();
+			build = stmt.getColumn(1).getString();
+			auto &stmtPort = db.cachedStatement("SELECT p.origin FROM failed_data f, port p WHERE f.build_id = ? AND p.id = f.port_id LIMIT 1");
+			stmtPort.bind(1, stmt.getColumn(2).getInt64());
+			if (stmtPort.executeStep())
+				port = stmtPort.getColumn(0).getString();
+		}
+	}
+	if (port.empty()) {
+		auto &stmt = db.cachedStatement("SELECT origin FROM port LIMIT 1");
+		if (stmt.executeStep())
+			port = stmt.getColumn(0).getString();
+	}
+	auto arch = masterbuild.substr(masterbuild.find('-') + 1); // masterbuild names are like main-amd64-default
+	arch = arch.substr(0, arch.find('-'));
+
+	args.clear();
+	for (auto &aname : query.args) {
+		std::string aval;
+		if (aname == "port-origin")
+			aval = port;
+		else if (aname == "masterbuild-name")
+			aval = masterbuild;
+		else if (aname == "build-name")
+			aval = build;
+		else if (aname == "arch")
+			aval = arch;
+		if (aval.empty())
+			return false;
+		args.push_back(aval);
+	}
+	return true;
+}
 
+static int doProfileAll() {
 	// checks
 	if (!checkDbIsPresentWithMessage("query"))
 		return EXIT_FAILURE;
 
-	// process the 'help' query
-	if (name == "help") {
-		// read the query set
-		Queries queries;
+	// DB object
+	Database db(false/*not create*/);
+
+	// profile all queries
+	Queries queries;
+	std::vector<std::tuple<std::string, std::vector<std::string>, QueryProfile>> profiles;
+	for (auto &nq : queries.queriesByName) {
+		auto &query = *nq.second;
+		std::vector<std::string> args;
+		if (!sampleQueryArgs(db, query, args)) {
+			WARNING("skipping the query '" << query << "': no sample values for its arguments")
+			continue;
+		}
+		if (fileContainsString(query.path.string(), "ports.sqlite") && !canOpenExistingPortsDB()) {
+			WARNING("skipping the query '" << query << "': PortsDB isn't available")
+			continue;
+		}
+		prepareQuery(db, query, args);
+		profiles.push_back({query.name, args, profileScript(db, query.sql(), args)});
+	}
 
-		// show all scripts
-		PRINT("available queries are:")
-		PRINT(queries)
+	// rank by wall time
+	std::stable_sort(profiles.begin(), profiles.end(), [](auto &p1, auto &p2) {
+		return std::get<2>(p1).wallSeconds > std::get<2>(p2).wallSeconds;
+	});
 
-		return EXIT_SUCCESS;
+	// print
+	auto ms = [](double seconds) {
+		return STR(std::fixed << std::setprecision(1) << seconds*1000);
+	};
+	std::vector<std::vector<std::string>> rows;
+	for (auto &p : profiles) {
+		auto &profile = std::get<2>(p);
+		std::ostringstream query;
+		query << std::get<0>(p);
+		for (auto &arg : std::get<1>(p))
+			query << ' ' << arg;
+		rows.push_back({
+			query.str(),
+			ms(profile.wallSeconds),
+			ms(profile.cpuSeconds),
+			STR(profile.rows()),
+			STR(profile.sum(&QueryProfile::Statement::fullScanSteps)),
+			STR(profile.sum(&QueryProfile::Statement::sorts)),
+			STR(profile.sum(&QueryProfile::Statement::autoIndexes)),
+			STR(profile.sum(&QueryProfile::Statement::vmSteps)),
+			profile.cacheHitRate()
+		});
 	}
+	printTable(std::cout, {"Query", "Wall ms", "CPU ms", "Rows", "Full scan steps", "Sorts", "Auto-indexes", "VM steps", "Cache hit rate"}, rows);
 
-	// read the query set
-	Queries queries(name.c_str());
+	return EXIT_SUCCESS;
+}
+
+static void runQuery(Database &db, const Queries &queries, const std::string &name, const std::vector<std::string> &args, OutputFormat format, bool profile, std::ostream &os) {
+	// process the 'help' query
+	if (name == "help") {
+		os << "available queries are:" << std::endl << queries << std::endl;
+		return;
+	}
 
 	// execute query if it exists
 	if (auto query = queries.find(name)) {
-		// check if PortsDB is needed and present
-		if (fileContainsString(query->path.string(), "ports.sqlite")) {
-			if (!canOpenExistingPortsDB())
-				FAIL("this query needs PortsDB, please install it with 'sudo pkg install portsdb', and fetch it with 'portsdb-import'")
-			if (!fileExists("ports.sqlite"))
-				fs::create_symlink(dbPathPortsDB(), "ports.sqlite");
-		}
-
-		// check that the number of arguments matches
-		if (args.size() != query->args.size())
-			FAIL("supplied " << args.size() << " argument(s) for the query expecting " << query->args.size() << " argument(s): " << *query)
-
-		// validate arguments if needed
-		for (unsigned a = 0; a < args.size(); a++) {
-			auto aname = query->args[a];
-			auto aval = args[a];
-			if (aname == "port-origin") {
-				if (!stmtReturnsAnyRows(db, STR("SELECT origin FROM queued WHERE origin='" << aval << "' LIMIT 1")))
-					FAIL("'" << aval << "' isn't a valid port")
-			} else if (aname == "masterbuild-name") {
-				if (!stmtReturnsAnyRows(db, STR("SELECT id FROM masterbuild WHERE name='" << aval << "' LIMIT 1")))
-					FAIL("masterbuild '" << aval << "' doesn't exist")
-			} else if (aname == "build-name") {
-				if (!stmtReturnsAnyRows(db, STR("SELECT id FROM build WHERE name='" << aval << "' LIMIT 1")))
-					FAIL("build '" << aval << "' doesn't exist")
-			} // we don't fail for other argument names since they might be added later
-		}
-
-		// convert arguments
-		std::string sargs;
-		for (auto &arg : args)
-			sargs += STR(" " << arg);
+		prepareQuery(db, *query, args);
 
 		// run SQL
-		auto res = ::system(CSTR(
-			"(echo .mode table; echo .header on; SQL=$(cat " << query->path << "); SQL=\"$(printf -- \"$SQL\"" << sargs << ")\"; echo \"$SQL\") | sqlite3 " << dbPath()
-		));
-		if (res != 0)
-			FAIL("SQL query failed to execute")
+		if (profile)
+			printProfile(os, profileScript(db, query->sql(), args));
+		else
+			runScript(db, query->sql(), args, format, os);
 	} else {
 		FAIL("query '" << name << "' doesn't exist, execute '" << argv0 << " query help' for the list of available queries")
 	}
+}
+
+static int doQuery(const std::string &name, const std::vector<std::string> &args, OutputFormat format, bool profile) {
+	// checks
+	if (!checkDbIsPresentWithMessage("query"))
+		return EXIT_FAILURE;
+
+	// DB object
+	Database db(false/*not create*/);
+
+	// read the query set: all queries for 'help'
+	Queries queries(name != "help" ? name.c_str() : nullptr);
+
+	// run
+	runQuery(db, queries, name, args, format, profile, std::cout);
+
+	return EXIT_SUCCESS;
+}
+
+//
+// serve: periodic fetches, and queries over a Unix socket from a resident process
+//
+
+struct SocketStreamBuf : std::streambuf { // buffered output into a socket
+	SocketStreamBuf(int fd_)
+	: fd(fd_)
+	{
+		setp(buffer, buffer + sizeof(buffer));
+	}
+	~SocketStreamBuf() {
+		sync();
+	}
+
+protected:
+	int overflow(int chr) override {
+		if (sync() != 0)
+			return traits_type::eof();
+		if (chr != traits_type::eof()) {
+			*pptr() = chr;
+			pbump(1);
+		}
+		return traits_type::not_eof(chr);
+	}
+	int sync() override {
+		for (char *p = pbase(); p < pptr();) {
+			auto n = ::send(fd, p, pptr() - p, MSG_NOSIGNAL);
+			if (n <= 0)
+				return -1; // the client has gone away
+			p += n;
+		}
+		setp(buffer, buffer + sizeof(buffer));
+		return 0;
+	}
+
+private:
+	int    fd;
+	char   buffer[64*1024];
+};
+
+static void serveQuery(Database &db, const Queries &queries, int fd) {
+	// the request is one line with the same arguments as the query command: [--format=...] [--profile] {query-name} {args...}
+	struct timeval timeout = {10, 0};
+	::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	std::string line;
+	char chr;
+	while (line.size() < 4096 && ::recv(fd, &chr, 1, 0) == 1 && chr != '\n')
+		line += chr;
+
+	SocketStreamBuf buf(fd);
+	std::ostream os(&buf);
+	try {
+		// parse
+		std::vector<std::string> words;
+		std::istringstream ss(line);
+		for (std::string word; ss >> word;)
+			words.push_back(word);
+		OutputFormat format = FormatTable;
+		bool profile = false;
+		unsigned w = 0;
+		for (; w < words.size() && words[w].rfind("--", 0) == 0; w++)
+			if (words[w].rfind("--format=", 0) == 0)
+				format = parseOutputFormat(words[w].substr(9));
+			else if (words[w] == "--profile")
+				profile = true;
+			else
+				FAIL("unknown option '" << words[w] << "'")
+		if (w == words.size())
+			FAIL("the request should be: [--format={table|jsonl|csv|tsv}] [--profile] {query-name} {args...}")
+
+		// run: the DB is upgraded by the first fetch
+		db.checkSchemaVersion();
+		runQuery(db, queries, words[w], std::vector<std::string>(words.begin() + w + 1, words.end()), format, profile, os);
+	} catch (std::exception &e) {
+		os << "error: " << e.what() << std::endl;
+	}
+	os.flush();
+
+	// leave the connection as it was: no read transaction stays open, and no DB stays attached
+	db.resetStatements();
+	std::vector<std::string> attached;
+	SQLite::Statement stmt(db, "SELECT name FROM pragma_database_list WHERE name NOT IN ('main', 'temp')");
+	while (stmt.executeStep())
+		attached.push_back(stmt.getColumn(0));
+	for (auto &name : attached)
+		db.exec(STR("DETACH \"" << name << "\""));
+}
+
+static int doServe() {
+	// SIGINT and SIGTERM are only received by the signal thread below: they cancel the fetch in progress and stop the server
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr); // before any thread is started
+	::signal(SIGPIPE, SIG_IGN);
+
+	// DB objects: fetches and queries use separate connections, in the WAL mode queries don't wait for fetches
+	Database db(true/*create*/);
+	db.exec("PRAGMA journal_mode = WAL");
+	db.setBusyTimeout(10*1000);
+	FetchSession session(db);
+	Database queryDb(false/*not create*/);
+	queryDb.setBusyTimeout(10*1000);
+
+	// queries are read once
+	Queries queries;
+
+	// listen
+	auto socketPath = ::getenv("BUILDSDB_SOCKET") ? std::string(::getenv("BUILDSDB_SOCKET")) : dbPath() + ".sock";
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socketPath.size() >= sizeof(addr.sun_path))
+		FAIL("the socket path '" << socketPath << "' is too long")
+	std::strcpy(addr.sun_path, socketPath.c_str());
+	if (fs::is_socket(socketPath)) // left by a previous instance
+		fs::remove(socketPath);
+	int listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0 || ::bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listenFd, 16) != 0)
+		FAIL("failed to listen on the socket '" << socketPath << "': " << std::strerror(errno))
+	MSG("serving queries on the socket " << socketPath)
+
+	// wait for a signal in its own thread, so that it is received while a fetch is in progress too
+	std::mutex stopMutex;
+	std::condition_variable stopCondition;
+	std::atomic<bool> stopping{false};
+	std::thread signalThread([&signals,&session,&stopMutex,&stopCondition,&stopping]() {
+		int sig = 0;
+		sigwait(&signals, &sig);
+		MSG("received the signal " << sig << ", stopping")
+		{
+			std::lock_guard<std::mutex> guard(stopMutex);
+			stopping = true;
+		}
+		stopCondition.notify_all();
+		session.cancel(); // the writer commits what it has, the next fetch resumes the run
+	});
+
+	// answer queries in their own thread, one at a time
+	std::thread queryThread([&queryDb,&queries,listenFd,&stopping]() {
+		while (!stopping) {
+			struct pollfd pfd = {listenFd, POLLIN, 0};
+			if (::poll(&pfd, 1, 1000/*ms*/) <= 0)
+				continue;
+			int fd = ::accept(listenFd, nullptr, nullptr);
+			if (fd < 0)
+				continue;
+			try {
+				serveQuery(queryDb, queries, fd);
+			} catch (std::exception &e) {
+				WARNING("failed to serve a query: " << e.what())
+			}
+			::close(fd);
+		}
+	});
+
+	// fetch periodically
+	auto interval = envUnsigned("BUILDSDB_SERVE_INTERVAL", 15*60);
+	while (!stopping) {
+		try {
+			session.fetch();
+		} catch (std::exception &e) {
+			WARNING("fetch failed: " << e.what())
+		}
+		if (stopping)
+			break;
+
+		// wait for the next fetch: with adaptive polling until the next build or masterbuild is due, but not longer than the interval
+		auto wait = interval;
+		if (auto due = session.nextDue())
+			wait = std::clamp(int64_t(due) - ::time(nullptr), int64_t(1), int64_t(interval));
+		MSG("next fetch in " << wait << " sec")
+		std::unique_lock<std::mutex> lock(stopMutex);
+		stopCondition.wait_for(lock, std::chrono::seconds(wait), [&stopping]() {
+			return stopping.load();
+		});
+	}
+
+	// stop
+	signalThread.join();
+	queryThread.join();
+	::close(listenFd);
+	fs::remove(socketPath);
 
 	return EXIT_SUCCESS;
 }
@@ -1253,9 +4277,11 @@ static int mainGuarded(int argc, char* argv[]) {
 		return usage(true);
 	else if (argc == 2) {
 		if (equals(argv[1], "fetch"))
-			return doFetch();
+			return doFetch(false/*offline*/);
+		else if (equals(argv[1], "serve"))
+			return doServe();
 		else if (equals(argv[1], "stats"))
-			return doStats();
+			return doStats(false/*tables*/);
 		else if (equals(argv[1], "show-masterbuilds"))
 			return doShowMasterbuilds(Any); // no additional args => Any
 		else if (equals(argv[1], "help"))
@@ -1264,10 +4290,14 @@ static int mainGuarded(int argc, char* argv[]) {
 			return usage(true);
 	} else {
 		if (argc == 3) {
-			if (equals(argv[1], "enable-masterbuilds"))
+			if (equals(argv[1], "fetch") && equals(argv[2], "--offline"))
+				return doFetch(true/*offline*/);
+			else if (equals(argv[1], "enable-masterbuilds"))
 				return doEnableMasterbuilds({std::string(argv[2])}, true);
 			else if (equals(argv[1], "disable-masterbuilds"))
 				return doEnableMasterbuilds({std::string(argv[2])}, false);
+			else if (equals(argv[1], "stats") && equals(argv[2], "tables"))
+				return doStats(true/*tables*/);
 			else if (equals(argv[1], "show-masterbuilds") && equals(argv[2], "enabled"))
 				return doShowMasterbuilds(Yes);
 			else if (equals(argv[1], "show-masterbuilds") && equals(argv[2], "disabled"))
@@ -1275,8 +4305,25 @@ static int mainGuarded(int argc, char* argv[]) {
 			else
 				{ } // fallthrough
 		}
-		if (equals(argv[1], "query"))
-			return doQuery(argv[2], std::vector<std::string>(argv + 3, argv + argc));
+		if (equals(argv[1], "query")) {
+			// options
+			OutputFormat format = FormatTable;
+			bool profile = false;
+			int a = 2;
+			for (; a < argc && std::strncmp(argv[a], "--", 2) == 0; a++)
+				if (std::strncmp(argv[a], "--format=", 9) == 0)
+					format = parseOutputFormat(argv[a] + 9);
+				else if (equals(argv[a], "--profile"))
+					profile = true;
+				else if (equals(argv[a], "--profile-all") && a + 1 == argc)
+					return doProfileAll();
+				else
+					return usage(true);
+			if (a == argc)
+				return usage(true);
+
+			return doQuery(argv[a], std::vector<std::string>(argv + a + 1, argv + argc), format, profile);
+		}
 
 		// fail to parse arguments
 		return usage(true);
@@ -8,13 +8,16 @@ const char *dbSchema = R"(
 
 	CREATE TABLE IF NOT EXISTS server (
 		id              INTEGER PRIMARY KEY AUTOINCREMENT,
-		url             TEXT NOT NULL UNIQUE
+		url             TEXT NOT NULL UNIQUE,
+		discovered      INTEGER NULL -- time of the last server discovery that has listed this server
 	);
 	CREATE TABLE IF NOT EXISTS masterbuild (
 		id              INTEGER PRIMARY KEY AUTOINCREMENT,
 		server_id       INTEGER NOT NULL,
 		name            TEXT NOT NULL UNIQUE,
 		enabled         INTEGER NOT NULL,
+		next_poll       INTEGER NULL, -- adaptive polling: time when the list of builds is due to be fetched again
+		poll_interval   INTEGER NULL,
 		FOREIGN KEY (server_id) REFERENCES server(id)
 	);
 	CREATE TABLE IF NOT EXISTS build (
@@ -25,6 +28,11 @@ const char *dbSchema = R"(
 		ended           INTEGER NULL,
 		status          TEXT NULL,
 		last_modified   TEXT NOT NULL,
+		etag            TEXT NULL,
+		content_hash    TEXT NULL, -- XXH64 of the build details as fetched, a body with the same hash isn't parsed again
+		sealed          INTEGER NOT NULL DEFAULT 0, -- the build has ended and its data will never change, it isn't fetched again
+		next_poll       INTEGER NULL, -- adaptive polling: time when the build is due to be fetched again
+		poll_interval   INTEGER NULL,
 		FOREIGN KEY (masterbuild_id) REFERENCES masterbuild(id)
 	);
 	CREATE INDEX IF NOT EXISTS index_build_masterbuild_id ON build(masterbuild_id);
@@ -35,53 +43,119 @@ const char *dbSchema = R"(
 	--	PRIMARY KEY     (build_id, origin, pkgname),
 	--	FOREIGN KEY (build_id) REFERENCES build(id)
 	--);
-	CREATE TABLE IF NOT EXISTS queued (
+	CREATE TABLE IF NOT EXISTS port ( -- dictionary of port origins, the per-port tables refer to origins by id
+		id              INTEGER PRIMARY KEY,
+		origin          TEXT NOT NULL UNIQUE
+	);
+	CREATE TABLE IF NOT EXISTS package ( -- dictionary of package names, the per-port tables refer to packages by id
+		id              INTEGER PRIMARY KEY,
+		pkgname         TEXT NOT NULL UNIQUE
+	);
+	CREATE TABLE IF NOT EXISTS queued_data (
 		build_id        INTEGER NOT NULL,
-		origin          TEXT NOT NULL,
-		pkgname         TEXT NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
 		reason          TEXT NOT NULL,
-		PRIMARY KEY     (build_id, origin, pkgname),
-		FOREIGN KEY (build_id) REFERENCES build(id)
-	);
-	CREATE INDEX IF NOT EXISTS index_queued_origin ON queued(origin);
-	CREATE TABLE IF NOT EXISTS built (
+		PRIMARY KEY     (build_id, port_id, package_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE IF NOT EXISTS built_data (
 		build_id        INTEGER NOT NULL,
-		origin          TEXT NOT NULL,
-		pkgname         TEXT NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
 		elapsed         INTEGER NOT NULL,
-		PRIMARY KEY     (build_id, origin, pkgname),
-		FOREIGN KEY (build_id) REFERENCES build(id)
-	);
-	CREATE INDEX IF NOT EXISTS index_built_origin ON built(origin);
-	CREATE TABLE IF NOT EXISTS failed (
+		PRIMARY KEY     (build_id, port_id, package_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE IF NOT EXISTS failed_data (
 		build_id        INTEGER NOT NULL,
-		origin          TEXT NOT NULL,
-		pkgname         TEXT NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
 		phase           TEXT NOT NULL,
 		errortype       TEXT NOT NULL,
 		elapsed         INTEGER NOT NULL,
-		PRIMARY KEY     (build_id, origin, pkgname),
-		FOREIGN KEY (build_id) REFERENCES build(id)
-	);
-	CREATE INDEX IF NOT EXISTS index_failed_origin ON failed(origin);
-	CREATE TABLE IF NOT EXISTS ignored (
+		PRIMARY KEY     (build_id, port_id, package_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE IF NOT EXISTS ignored_data (
 		build_id        INTEGER NOT NULL,
-		origin          TEXT NOT NULL,
-		pkgname         TEXT NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
 		reason          TEXT NOT NULL,
-		PRIMARY KEY     (build_id, origin, pkgname, reason),
-		FOREIGN KEY (build_id) REFERENCES build(id)
-	);
-	CREATE INDEX IF NOT EXISTS index_ignored_origin ON ignored(origin);
-	CREATE TABLE IF NOT EXISTS skipped (
+		PRIMARY KEY     (build_id, port_id, package_id, reason),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE IF NOT EXISTS skipped_data (
 		build_id        INTEGER NOT NULL,
-		origin          TEXT NOT NULL,
-		pkgname         TEXT NOT NULL,
-		depends         TEXT NOT NULL,
-		PRIMARY KEY     (build_id, origin, pkgname, depends),
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
+		depends_id      INTEGER NOT NULL, -- package that has caused the skip
+		PRIMARY KEY     (build_id, port_id, package_id, depends_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id),
+		FOREIGN KEY (depends_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE IF NOT EXISTS port_state ( -- latest builds of each masterbuild where each port has failed, was built, ignored or skipped, maintained by the writer
+		masterbuild_id  INTEGER NOT NULL,
+		port_id         INTEGER NOT NULL,
+		last_failed_build_id INTEGER NULL,
+		last_failed     INTEGER NULL,
+		last_succeeded  INTEGER NULL,
+		last_ignored    INTEGER NULL,
+		last_skipped    INTEGER NULL,
+		broken          INTEGER GENERATED ALWAYS AS (
+			last_failed IS NOT NULL AND last_failed > max(coalesce(last_succeeded, 0), coalesce(last_ignored, 0))
+		) STORED,
+		PRIMARY KEY     (masterbuild_id, port_id),
+		FOREIGN KEY (masterbuild_id) REFERENCES masterbuild(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (last_failed_build_id) REFERENCES build(id)
+	) WITHOUT ROWID;
+	CREATE TABLE IF NOT EXISTS build_counts ( -- per-build totals, maintained by the writer
+		build_id        INTEGER PRIMARY KEY,
+		num_queued      INTEGER NOT NULL,
+		num_built       INTEGER NOT NULL,
+		num_failed      INTEGER NOT NULL,
+		num_ignored     INTEGER NOT NULL,
+		num_skipped     INTEGER NOT NULL,
+		elapsed_built   INTEGER NOT NULL, -- sum of elapsed times, in seconds
+		elapsed_failed  INTEGER NOT NULL,
 		FOREIGN KEY (build_id) REFERENCES build(id)
 	);
-	CREATE INDEX IF NOT EXISTS index_skipped_origin ON skipped(origin);
+	CREATE TABLE IF NOT EXISTS masterbuild_counts ( -- per-masterbuild sums of build_counts, maintained by the writer
+		masterbuild_id  INTEGER PRIMARY KEY,
+		num_builds      INTEGER NOT NULL,
+		num_queued      INTEGER NOT NULL,
+		num_built       INTEGER NOT NULL,
+		num_failed      INTEGER NOT NULL,
+		num_ignored     INTEGER NOT NULL,
+		num_skipped     INTEGER NOT NULL,
+		elapsed_built   INTEGER NOT NULL,
+		elapsed_failed  INTEGER NOT NULL,
+		FOREIGN KEY (masterbuild_id) REFERENCES masterbuild(id)
+	);
+	CREATE TABLE IF NOT EXISTS fetch_run ( -- fetches, the one that hasn't ended was interrupted and is resumed by the next fetch
+		id              INTEGER PRIMARY KEY AUTOINCREMENT,
+		started         INTEGER NOT NULL,
+		ended           INTEGER NULL,
+		bulk_load       INTEGER NOT NULL, -- the run loads an empty DB in the bulk-load mode
+		journal_mode    TEXT NULL -- of the DB before the bulk load switched it to WAL, restored when the run completes
+	);
+	CREATE TABLE IF NOT EXISTS fetch_progress ( -- URLs of builds saved by the run that hasn't ended, written in the same transaction as the build
+		run_id          INTEGER NOT NULL,
+		url             TEXT NOT NULL,
+		PRIMARY KEY (run_id, url),
+		FOREIGN KEY (run_id) REFERENCES fetch_run(id)
+	) WITHOUT ROWID;
 	CREATE TABLE IF NOT EXISTS schema_version (
 		version         INTEGER NOT NULL
 	);
@@ -90,6 +164,88 @@ const char *dbSchema = R"(
 	-- Views
 	--
 
+	-- per-port tables with origins and package names, as they were stored before the dictionaries were introduced
+	CREATE VIEW IF NOT EXISTS queued AS
+	SELECT
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		d.reason AS reason
+	FROM
+		queued_data d,
+		port p,
+		package k
+	WHERE
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+	;
+	CREATE VIEW IF NOT EXISTS built AS
+	SELECT
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		d.elapsed AS elapsed
+	FROM
+		built_data d,
+		port p,
+		package k
+	WHERE
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+	;
+	CREATE VIEW IF NOT EXISTS failed AS
+	SELECT
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		d.phase AS phase,
+		d.errortype AS errortype,
+		d.elapsed AS elapsed
+	FROM
+		failed_data d,
+		port p,
+		package k
+	WHERE
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+	;
+	CREATE VIEW IF NOT EXISTS ignored AS
+	SELECT
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		d.reason AS reason
+	FROM
+		ignored_data d,
+		port p,
+		package k
+	WHERE
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+	;
+	CREATE VIEW IF NOT EXISTS skipped AS
+	SELECT
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		dk.pkgname AS depends
+	FROM
+		skipped_data d,
+		port p,
+		package k,
+		package dk
+	WHERE
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+		AND
+		dk.id = d.depends_id
+	;
+
 	CREATE VIEW IF NOT EXISTS server_masterbuild_build AS -- this view is for debugging purposes only
 	SELECT
 		s.id AS server_id,
@@ -105,15 +261,19 @@ const char *dbSchema = R"(
 		datetime(b.ended, 'unixepoch', 'localtime') AS build_ended_str,
 		b.status AS build_status,
 		b.last_modified AS build_last_modified,
-		(SELECT count(*) FROM queued WHERE build_id = b.id) AS num_queued,
-		(SELECT count(*) FROM built WHERE build_id = b.id) AS num_built,
-		(SELECT count(*) FROM failed WHERE build_id = b.id) AS num_failed,
-		(SELECT count(*) FROM skipped WHERE build_id = b.id) AS num_skipped,
-		(SELECT count(*) FROM ignored WHERE build_id = b.id) AS num_ignored
+		c.num_queued AS num_queued,
+		c.num_built AS num_built,
+		c.num_failed AS num_failed,
+		c.num_skipped AS num_skipped,
+		c.num_ignored AS num_ignored
 	FROM
 		server s,
 		masterbuild m,
 		build b
+	LEFT JOIN
+		build_counts c
+	ON
+		c.build_id = b.id
 	WHERE
 		s.id = m.server_id
 		AND
@@ -122,81 +282,126 @@ const char *dbSchema = R"(
 
 	CREATE VIEW IF NOT EXISTS failed_last AS
 	SELECT
-		*
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		d.phase AS phase,
+		d.errortype AS errortype,
+		d.elapsed AS elapsed,
+		d.port_id AS port_id
 	FROM
-		failed f
+		failed_data d,
+		port p,
+		package k
 	WHERE
-		f.build_id = (
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+		AND
+		d.build_id = (
 			SELECT
-				id
+				b.id
 			FROM
-				build
+				build b
 			WHERE
-				masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = f.build_id)
+				b.masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = d.build_id)
 				AND
-				EXISTS (SELECT * FROM failed WHERE origin = f.origin AND build_id = id)
+				EXISTS (SELECT * FROM failed_data WHERE build_id = b.id AND port_id = d.port_id)
 			ORDER BY
-				started DESC
+				b.started DESC
 			LIMIT 1
 		)
 	;
 	CREATE VIEW IF NOT EXISTS built_last AS
 	SELECT
-		*
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		d.elapsed AS elapsed,
+		d.port_id AS port_id
 	FROM
-		built s
+		built_data d,
+		port p,
+		package k
 	WHERE
-		s.build_id = (
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+		AND
+		d.build_id = (
 			SELECT
-				id
+				b.id
 			FROM
-				build
+				build b
 			WHERE
-				masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = s.build_id)
+				b.masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = d.build_id)
 				AND
-				EXISTS (SELECT * FROM built WHERE origin = s.origin AND build_id = id)
+				EXISTS (SELECT * FROM built_data WHERE build_id = b.id AND port_id = d.port_id)
 			ORDER BY
-				started DESC
+				b.started DESC
 			LIMIT 1
 		)
 	;
 	CREATE VIEW IF NOT EXISTS ignored_last AS
 	SELECT
-		*
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		d.reason AS reason,
+		d.port_id AS port_id
 	FROM
-		ignored i
+		ignored_data d,
+		port p,
+		package k
 	WHERE
-		i.build_id = (
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+		AND
+		d.build_id = (
 			SELECT
-				id
+				b.id
 			FROM
-				build
+				build b
 			WHERE
-				masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = i.build_id)
+				b.masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = d.build_id)
 				AND
-				EXISTS (SELECT * FROM ignored WHERE origin = i.origin AND build_id = id)
+				EXISTS (SELECT * FROM ignored_data WHERE build_id = b.id AND port_id = d.port_id)
 			ORDER BY
-				started DESC
+				b.started DESC
 			LIMIT 1
 		)
 	;
 	CREATE VIEW IF NOT EXISTS skipped_last AS
 	SELECT
-		*
+		d.build_id AS build_id,
+		p.origin AS origin,
+		k.pkgname AS pkgname,
+		dk.pkgname AS depends,
+		d.port_id AS port_id
 	FROM
-		skipped s
+		skipped_data d,
+		port p,
+		package k,
+		package dk
 	WHERE
-		s.build_id = (
+		p.id = d.port_id
+		AND
+		k.id = d.package_id
+		AND
+		dk.id = d.depends_id
+		AND
+		d.build_id = (
 			SELECT
-				id
+				b.id
 			FROM
-				build
+				build b
 			WHERE
-				masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = s.build_id)
+				b.masterbuild_id = (SELECT masterbuild_id FROM build WHERE id = d.build_id)
 				AND
-				EXISTS (SELECT * FROM skipped WHERE origin = s.origin AND build_id = id)
+				EXISTS (SELECT * FROM skipped_data WHERE build_id = b.id AND port_id = d.port_id)
 			ORDER BY
-				started DESC
+				b.started DESC
 			LIMIT 1
 		)
 	;
@@ -206,53 +411,286 @@ const char *dbSchema = R"(
 		m.name AS masterbuild_name,
 		bf.id AS build_id,
 		bf.name AS build_name,
-		f.origin AS origin,
+		p.origin AS origin,
 		f.phase AS phase,
 		f.errortype AS errortype,
 		f.elapsed AS elapsed,
-		bf.started AS last_failed,
-		(SELECT started FROM build WHERE id = s.build_id) AS last_succeeded,
-		(SELECT started FROM build WHERE id = i.build_id) AS last_ignored,
-		(SELECT started FROM build WHERE id = k.build_id) AS last_skipped
+		ps.last_failed AS last_failed,
+		ps.last_succeeded AS last_succeeded,
+		ps.last_ignored AS last_ignored,
+		ps.last_skipped AS last_skipped
 	FROM
+		port_state ps,
 		masterbuild m,
 		build bf,
-		failed_last f
-	LEFT JOIN
-		built_last s
-	ON
-		s.build_id in (SELECT id FROM build WHERE masterbuild_id = m.id)
+		port p,
+		failed_data f
+	WHERE
+		ps.broken
 		AND
-		s.origin = f.origin
-	LEFT JOIN
-		ignored_last i
-	ON
-		i.build_id in (SELECT id FROM build WHERE masterbuild_id = m.id)
+		m.id = ps.masterbuild_id
 		AND
-		i.origin = f.origin
-	LEFT JOIN
-		skipped_last k
-	ON
-		k.build_id in (SELECT id FROM build WHERE masterbuild_id = m.id)
+		m.enabled = 1
 		AND
-		k.origin = f.origin
-	WHERE
-		m.id = bf.masterbuild_id
+		bf.id = ps.last_failed_build_id
 		AND
-		m.enabled = 1
+		p.id = ps.port_id
 		AND
-		bf.id = f.build_id
+		f.build_id = ps.last_failed_build_id
 		AND
-		(
-			(last_succeeded IS NULL AND last_ignored IS NULL)
-			OR
-			(last_succeeded IS NOT NULL AND last_ignored IS NULL AND last_failed > last_succeeded)
-			OR
-			(last_succeeded IS NULL AND last_ignored IS NOT NULL AND last_failed > last_ignored)
-			OR
-			(last_succeeded IS NOT NULL AND last_ignored IS NOT NULL AND last_failed > max(last_succeeded, last_ignored))
-		)
+		f.port_id = ps.port_id
 	ORDER BY
 		last_failed
 	;
 )";
+
+const char *dbSchemaIndexes = R"(
+	--
+	-- Secondary indexes on the per-port tables, they are created after the data is loaded in the bulk-load mode
+	--
+
+	CREATE INDEX IF NOT EXISTS index_queued_data_port_id ON queued_data(port_id);
+	CREATE INDEX IF NOT EXISTS index_built_data_port_id ON built_data(port_id);
+	CREATE INDEX IF NOT EXISTS index_failed_data_port_id ON failed_data(port_id);
+	CREATE INDEX IF NOT EXISTS index_ignored_data_port_id ON ignored_data(port_id);
+	CREATE INDEX IF NOT EXISTS index_skipped_data_port_id ON skipped_data(port_id);
+	CREATE INDEX IF NOT EXISTS index_port_state_broken ON port_state(masterbuild_id) WHERE broken;
+)";
+
+//
+// Upgrades of databases created by earlier versions: dbSchemaUpgrades[N] brings the schema from version N to N+1.
+// New objects are created by dbSchema after all upgrades are applied, a newly created DB is at the latest version.
+//
+
+const char *dbSchemaUpgrades[] = {
+	// 0 -> 1: ETag is stored next to Last-Modified for conditional requests
+	R"(
+	ALTER TABLE build ADD COLUMN etag TEXT NULL;
+	)",
+
+	// 1 -> 2: the discovered server list is cached
+	R"(
+	ALTER TABLE server ADD COLUMN discovered INTEGER NULL;
+	)",
+
+	// 2 -> 3: builds that have ended are sealed
+	R"(
+	ALTER TABLE build ADD COLUMN sealed INTEGER NOT NULL DEFAULT 0;
+	UPDATE build SET sealed = 1 WHERE ended IS NOT NULL AND status LIKE 'stopped:%';
+	)",
+
+	// 3 -> 4: origins and package names are moved into the port and package dictionaries, the per-port tables become views
+	R"(
+	DROP VIEW IF EXISTS broken;
+	DROP VIEW IF EXISTS failed_last;
+	DROP VIEW IF EXISTS built_last;
+	DROP VIEW IF EXISTS ignored_last;
+	DROP VIEW IF EXISTS skipped_last;
+	DROP VIEW IF EXISTS server_masterbuild_build;
+
+	CREATE TABLE port (
+		id              INTEGER PRIMARY KEY,
+		origin          TEXT NOT NULL UNIQUE
+	);
+	CREATE TABLE package (
+		id              INTEGER PRIMARY KEY,
+		pkgname         TEXT NOT NULL UNIQUE
+	);
+	CREATE TABLE queued_data (
+		build_id        INTEGER NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
+		reason          TEXT NOT NULL,
+		PRIMARY KEY     (build_id, port_id, package_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE built_data (
+		build_id        INTEGER NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
+		elapsed         INTEGER NOT NULL,
+		PRIMARY KEY     (build_id, port_id, package_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE failed_data (
+		build_id        INTEGER NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
+		phase           TEXT NOT NULL,
+		errortype       TEXT NOT NULL,
+		elapsed         INTEGER NOT NULL,
+		PRIMARY KEY     (build_id, port_id, package_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE ignored_data (
+		build_id        INTEGER NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
+		reason          TEXT NOT NULL,
+		PRIMARY KEY     (build_id, port_id, package_id, reason),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+	CREATE TABLE skipped_data (
+		build_id        INTEGER NOT NULL,
+		port_id         INTEGER NOT NULL,
+		package_id      INTEGER NOT NULL,
+		depends_id      INTEGER NOT NULL,
+		PRIMARY KEY     (build_id, port_id, package_id, depends_id),
+		FOREIGN KEY (build_id) REFERENCES build(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (package_id) REFERENCES package(id),
+		FOREIGN KEY (depends_id) REFERENCES package(id)
+	) WITHOUT ROWID;
+
+	INSERT INTO port(origin)
+		SELECT origin FROM queued UNION SELECT origin FROM built UNION SELECT origin FROM failed UNION SELECT origin FROM ignored UNION SELECT origin FROM skipped;
+	INSERT INTO package(pkgname)
+		SELECT pkgname FROM queued UNION SELECT pkgname FROM built UNION SELECT pkgname FROM failed UNION SELECT pkgname FROM ignored UNION SELECT pkgname FROM skipped
+		UNION SELECT depends FROM skipped;
+
+	INSERT INTO queued_data
+		SELECT t.build_id, p.id, k.id, t.reason FROM queued t, port p, package k WHERE p.origin = t.origin AND k.pkgname = t.pkgname;
+	INSERT INTO built_data
+		SELECT t.build_id, p.id, k.id, t.elapsed FROM built t, port p, package k WHERE p.origin = t.origin AND k.pkgname = t.pkgname;
+	INSERT INTO failed_data
+		SELECT t.build_id, p.id, k.id, t.phase, t.errortype, t.elapsed FROM failed t, port p, package k WHERE p.origin = t.origin AND k.pkgname = t.pkgname;
+	INSERT INTO ignored_data
+		SELECT t.build_id, p.id, k.id, t.reason FROM ignored t, port p, package k WHERE p.origin = t.origin AND k.pkgname = t.pkgname;
+	INSERT INTO skipped_data
+		SELECT t.build_id, p.id, k.id, dk.id FROM skipped t, port p, package k, package dk WHERE p.origin = t.origin AND k.pkgname = t.pkgname AND dk.pkgname = t.depends;
+
+	DROP TABLE queued;
+	DROP TABLE built;
+	DROP TABLE failed;
+	DROP TABLE ignored;
+	DROP TABLE skipped;
+	)",
+
+	// 4 -> 5: the broken view reads the port_state table maintained by the writer instead of the *_last views
+	R"(
+	DROP VIEW IF EXISTS broken;
+
+	CREATE TABLE port_state (
+		masterbuild_id  INTEGER NOT NULL,
+		port_id         INTEGER NOT NULL,
+		last_failed_build_id INTEGER NULL,
+		last_failed     INTEGER NULL,
+		last_succeeded  INTEGER NULL,
+		last_ignored    INTEGER NULL,
+		last_skipped    INTEGER NULL,
+		broken          INTEGER GENERATED ALWAYS AS (
+			last_failed IS NOT NULL AND last_failed > max(coalesce(last_succeeded, 0), coalesce(last_ignored, 0))
+		) STORED,
+		PRIMARY KEY     (masterbuild_id, port_id),
+		FOREIGN KEY (masterbuild_id) REFERENCES masterbuild(id),
+		FOREIGN KEY (port_id) REFERENCES port(id),
+		FOREIGN KEY (last_failed_build_id) REFERENCES build(id)
+	) WITHOUT ROWID;
+
+	INSERT INTO port_state(masterbuild_id, port_id, last_failed, last_succeeded, last_ignored, last_skipped)
+		SELECT masterbuild_id, port_id, max(f), max(s), max(i), max(k) FROM (
+			SELECT b.masterbuild_id, d.port_id, b.started AS f, NULL AS s, NULL AS i, NULL AS k FROM failed_data d, build b WHERE b.id = d.build_id
+			UNION ALL
+			SELECT b.masterbuild_id, d.port_id, NULL, b.started, NULL, NULL FROM built_data d, build b WHERE b.id = d.build_id
+			UNION ALL
+			SELECT b.masterbuild_id, d.port_id, NULL, NULL, b.started, NULL FROM ignored_data d, build b WHERE b.id = d.build_id
+			UNION ALL
+			SELECT b.masterbuild_id, d.port_id, NULL, NULL, NULL, b.started FROM skipped_data d, build b WHERE b.id = d.build_id
+		)
+		GROUP BY masterbuild_id, port_id;
+	UPDATE port_state SET last_failed_build_id = (
+		SELECT b.id FROM failed_data d, build b
+		WHERE d.port_id = port_state.port_id AND b.id = d.build_id AND b.masterbuild_id = port_state.masterbuild_id
+		ORDER BY b.started DESC LIMIT 1
+	) WHERE last_failed IS NOT NULL;
+	)",
+
+	// 5 -> 6: per-build and per-masterbuild counts are maintained by the writer
+	R"(
+	DROP VIEW IF EXISTS server_masterbuild_build;
+
+	CREATE TABLE build_counts (
+		build_id        INTEGER PRIMARY KEY,
+		num_queued      INTEGER NOT NULL,
+		num_built       INTEGER NOT NULL,
+		num_failed      INTEGER NOT NULL,
+		num_ignored     INTEGER NOT NULL,
+		num_skipped     INTEGER NOT NULL,
+		elapsed_built   INTEGER NOT NULL,
+		elapsed_failed  INTEGER NOT NULL,
+		FOREIGN KEY (build_id) REFERENCES build(id)
+	);
+	CREATE TABLE masterbuild_counts (
+		masterbuild_id  INTEGER PRIMARY KEY,
+		num_builds      INTEGER NOT NULL,
+		num_queued      INTEGER NOT NULL,
+		num_built       INTEGER NOT NULL,
+		num_failed      INTEGER NOT NULL,
+		num_ignored     INTEGER NOT NULL,
+		num_skipped     INTEGER NOT NULL,
+		elapsed_built   INTEGER NOT NULL,
+		elapsed_failed  INTEGER NOT NULL,
+		FOREIGN KEY (masterbuild_id) REFERENCES masterbuild(id)
+	);
+
+	INSERT INTO build_counts
+		SELECT
+			b.id,
+			(SELECT count(*) FROM queued_data WHERE build_id = b.id),
+			(SELECT count(*) FROM built_data WHERE build_id = b.id),
+			(SELECT count(*) FROM failed_data WHERE build_id = b.id),
+			(SELECT count(*) FROM ignored_data WHERE build_id = b.id),
+			(SELECT count(*) FROM skipped_data WHERE build_id = b.id),
+			(SELECT coalesce(sum(elapsed), 0) FROM built_data WHERE build_id = b.id),
+			(SELECT coalesce(sum(elapsed), 0) FROM failed_data WHERE build_id = b.id)
+		FROM
+			build b;
+	INSERT INTO masterbuild_counts
+		SELECT
+			b.masterbuild_id, count(*),
+			sum(c.num_queued), sum(c.num_built), sum(c.num_failed), sum(c.num_ignored), sum(c.num_skipped),
+			sum(c.elapsed_built), sum(c.elapsed_failed)
+		FROM
+			build b,
+			build_counts c
+		WHERE
+			c.build_id = b.id
+		GROUP BY
+			b.masterbuild_id;
+	)",
+
+	// 6 -> 7: adaptive polling schedule
+	R"(
+	ALTER TABLE masterbuild ADD COLUMN next_poll INTEGER NULL;
+	ALTER TABLE masterbuild ADD COLUMN poll_interval INTEGER NULL;
+	ALTER TABLE build ADD COLUMN next_poll INTEGER NULL;
+	ALTER TABLE build ADD COLUMN poll_interval INTEGER NULL;
+	)",
+
+	// 7 -> 8: hash of the build details
+	R"(
+	ALTER TABLE build ADD COLUMN content_hash TEXT NULL;
+	)",
+
+	// 8 -> 9: the journal mode before the bulk load is kept with the run, so that the fetch that resumes it restores the mode
+	R"(
+	CREATE TABLE IF NOT EXISTS fetch_run ( -- the fetch journal was added without a version change, older DBs don't have it
+		id              INTEGER PRIMARY KEY AUTOINCREMENT,
+		started         INTEGER NOT NULL,
+		ended           INTEGER NULL,
+		bulk_load       INTEGER NOT NULL
+	);
+	ALTER TABLE fetch_run ADD COLUMN journal_mode TEXT NULL;
+	UPDATE fetch_run SET journal_mode = 'delete' WHERE bulk_load AND ended IS NULL; -- the bulk load started on a new DB, which is in the default mode
+	)",
+
+	nullptr
+};
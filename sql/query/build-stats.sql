@@ -5,17 +5,20 @@ SELECT
 	b.name AS Build,
 	datetime(b.started, 'unixepoch', 'localtime') AS Started,
 	datetime(b.ended, 'unixepoch', 'localtime') AS Ended,
-	(SELECT count(*) FROM built   WHERE build_id = b.id) AS Queued,
-	(SELECT count(*) FROM built   WHERE build_id = b.id) AS Built,
-	(SELECT count(*) FROM failed  WHERE build_id = b.id) AS Failed,
-	(SELECT count(*) FROM ignored WHERE build_id = b.id) AS Ignored,
-	(SELECT count(*) FROM skipped WHERE build_id = b.id) AS Skipped
+	c.num_queued AS Queued,
+	c.num_built AS Built,
+	c.num_failed AS Failed,
+	c.num_ignored AS Ignored,
+	c.num_skipped AS Skipped
 FROM
 	masterbuild m,
-	build b
+	build b,
+	build_counts c
 WHERE
 	m.id = b.masterbuild_id
 	AND
+	c.build_id = b.id
+	AND
 	m.enabled = 1
 ORDER BY
 	Started,
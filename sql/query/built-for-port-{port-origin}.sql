@@ -20,7 +20,7 @@ WHERE
 	AND
 	m.enabled = 1
 	AND
-	s.origin = '%s'
+	s.origin = {port-origin}
 ORDER BY
 	BuildStarted,
 	Masterbuild,
@@ -15,6 +15,6 @@ WHERE
 	AND
 	b.id = l.build_id
 	AND
-	m.name = '%s'
+	m.name = {masterbuild-name}
 	AND
-	b.name = '%s'
+	b.name = {build-name}
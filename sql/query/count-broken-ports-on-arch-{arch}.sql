@@ -5,4 +5,4 @@ SELECT
 FROM
 	broken
 WHERE
-	masterbuild_name LIKE '%%%s-%%'
+	masterbuild_name LIKE '%' || {arch} || '-%'
@@ -5,7 +5,7 @@ SELECT
 FROM
 	broken
 WHERE
-	masterbuild_name LIKE '%%amd64%%'
+	masterbuild_name LIKE '%amd64%'
 	OR
-	masterbuild_name LIKE '%%arm64%%'
+	masterbuild_name LIKE '%arm64%'
 
@@ -22,7 +22,7 @@ WHERE
 	AND
 	m.enabled = 1
 	AND
-	f.origin = '%s'
+	f.origin = {port-origin}
 ORDER BY
 	BuildStarted,
 	Masterbuild,